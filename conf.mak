@@ -18,7 +18,7 @@ LUAINCS		= -I/usr/include/lua5.1
 CFLAGS		= -I. $(LUAINCS) $(WIN32FLAG) $(WIN32CFLAGS)
 CXXFLAGS	= -I. $(LUAINCS) $(WIN32FLAG) $(WIN32CFLAGS)
 
-LDFLAGS		= -lffi -llua5.1 -lm $(WIN32FLAG)
+LDFLAGS		= -lffi -llua5.1 -lm -lpthread $(WIN32FLAG)
 
 RCFLAGS		= $(CFLAGS)
 RCXXFLAGS	= $(CXXFLAGS)
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <ffi.h>
 
 #define REG(name) { #name, lua_##name }
@@ -75,6 +77,30 @@ static udatareg_t abis[] = {
     NULL
 };
 
+/* a Tlstring argument passes a lua string or buffer as two C arguments,
+ * a pointer to its bytes and its size_t length, which new_cif expands
+ * into a pointer and a type_lstrlen */
+#define TYPE_LSTRING 100
+
+static ffi_type type_lstring = {
+    sizeof(void *), sizeof(void *), TYPE_LSTRING, NULL
+};
+static ffi_type type_lstrlen = {
+    sizeof(size_t), sizeof(size_t),
+    sizeof(size_t) == 8 ? FFI_TYPE_UINT64 : FFI_TYPE_UINT32, NULL
+};
+
+/* an out argument is a pointer to a scratch value in the call frame,
+ * returned as an extra result, and an inout one also stores the value of
+ * its lua argument there first. Its type is a pointer type whose elements
+ * point to the type of the value. */
+typedef struct {
+    ffi_type type;
+    ffi_type *elements[2];      /* the type of the value, NULL */
+    int inout;
+} outtype_t;
+
+#define OUTTYPE(t) ((outtype_t *) ((char *) (t)->elements - offsetof(outtype_t, elements)))
 
 static udatareg_t types[] = {
     { "Tchar", &ffi_type_schar },
@@ -102,553 +128,5807 @@ static udatareg_t types[] = {
     { "Tdouble", &ffi_type_double },
     { "Tpointer", &ffi_type_pointer },
     { "Tlongdouble", &ffi_type_longdouble },
+    { "Tlstring", &type_lstring },
     NULL
 };
 
-static int lua_prep_cif(lua_State *L)
-{
-    ffi_cif *cif;
-    int nargs = lua_gettop(L) - 2;
-    ffi_type **types;
+/* marshaling plans
+ *
+ * Every cif carries a precomputed plan: one opcode per argument and the
+ * offset of its value in a single call frame, so that a call reserves
+ * one buffer and runs a tight copy loop instead of switching on
+ * cif->arg_types[i]->type and doing an alloca per argument. */
+
+enum {
+    OP_VOID,
+    OP_INT,
+    OP_SINT8,
+    OP_SINT16,
+    OP_SINT32,
+    OP_SINT64,
+    OP_UINT8,
+    OP_UINT16,
+    OP_UINT32,
+    OP_UINT64,
+    OP_FLOAT,
+    OP_DOUBLE,
+    OP_LONGDOUBLE,
+    OP_STRUCT,
+    OP_POINTER,
+    OP_LSTRLEN,                 /* length of the Tlstring before it */
+    OP_OUT                      /* pointer to an out value */
+};
+
+typedef struct {
+    int op;
+    int larg;                   /* index of the lua argument, from 0 */
+    size_t offset;              /* of the value in the call frame */
+    int top;                    /* opcode of an out value */
+    int inout;                  /* the out value is also an argument */
+    size_t toffset;             /* of the out value in the call frame */
+} argplan_t;
+
+/* values passed to and returned by the specialized call stubs */
+typedef union {
     int i;
+    void *p;
+    double d;
+} stubval_t;
 
-    if (nargs < 0)
-        return 0;
-    
-    cif = lua_newuserdata(L, sizeof(ffi_cif) + sizeof(ffi_type *) * nargs);
+typedef void (*stub_t)(void *f, stubval_t *args, stubval_t *res);
 
-    luaL_getmetatable(L, "ffi_cif");
-    lua_setmetatable(L, -2);
+/* jit compiled call thunk, loads the arguments from the call frame */
+typedef void (*thunk_t)(void *f, uint8_t *frame, void *rval);
 
-    types = (ffi_type **) (cif + 1);
+typedef struct {
+    ffi_cif cif;                /* must come first, a cif_t is also an ffi_cif */
+    int rop;                    /* opcode of the return value */
+    size_t roffset;             /* of the return value in the call frame */
+    size_t frame;               /* total size of the call frame */
+    stub_t stub;                /* direct call stub, or NULL to use ffi_call */
+    thunk_t thunk;              /* active jit thunk, takes precedence over the stub */
+    thunk_t compiled;           /* compiled jit thunk, active or not */
+    void *code;                 /* writable address of the compiled thunk */
+    int variadic;               /* prepared by ffi_prep_cif_var */
+    int nlargs;                 /* lua arguments, a Tlstring takes two C ones */
+    int nouts;                  /* out arguments */
+    argplan_t *args;
+} cif_t;
 
-    for (i = 0; i < nargs; i++)
-        types[i] = (ffi_type *) luaL_checkudata(L, i + 3, "ffi_type");
+#define ALIGN(n, a) (((n) + (a) - 1) & ~((size_t) (a) - 1))
 
-    if (ffi_prep_cif(cif, (ffi_abi) lua_touserdata(L, 1), nargs, (ffi_type *) luaL_checkudata(L, 2, "ffi_type"), types) != FFI_OK)
-        return 0;
+static int type_op(ffi_type *type)
+{
+    if (type == &type_lstrlen)
+        return OP_LSTRLEN;
+    switch (type->type) {
+        case FFI_TYPE_VOID: return OP_VOID;
+        case FFI_TYPE_INT: return OP_INT;
+        case FFI_TYPE_SINT8: return OP_SINT8;
+        case FFI_TYPE_SINT16: return OP_SINT16;
+        case FFI_TYPE_SINT32: return OP_SINT32;
+        case FFI_TYPE_SINT64: return OP_SINT64;
+        case FFI_TYPE_UINT8: return OP_UINT8;
+        case FFI_TYPE_UINT16: return OP_UINT16;
+        case FFI_TYPE_UINT32: return OP_UINT32;
+        case FFI_TYPE_UINT64: return OP_UINT64;
+        case FFI_TYPE_FLOAT: return OP_FLOAT;
+        case FFI_TYPE_DOUBLE: return OP_DOUBLE;
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+        case FFI_TYPE_LONGDOUBLE: return OP_LONGDOUBLE;
+#endif
+        case FFI_TYPE_STRUCT: return OP_STRUCT;
+        case FFI_TYPE_POINTER: return type->elements ? OP_OUT : OP_POINTER;
+        default: return OP_POINTER;
+    }
+}
 
-    return 1;
+/* specialized call stubs
+ *
+ * Signatures of up to four int, pointer or double arguments returning
+ * void, int, pointer or double don't need the generic machinery of
+ * ffi_call: a stub casts the function pointer to the exact C type and
+ * calls it directly. The 484 stubs and their lookup table are generated
+ * by the macros below, stub_<ret>_<args> is for instance stub_d_ipd for
+ * double (*)(int, void *, double). */
+
+#define STUB_T_v void
+#define STUB_T_i int
+#define STUB_T_p void *
+#define STUB_T_d double
+
+#define STUB_R_v(call) call
+#define STUB_R_i(call) res->i = call
+#define STUB_R_p(call) res->p = call
+#define STUB_R_d(call) res->d = call
+
+#define STUB_DEF0(kr) \
+    static void stub_##kr##_(void *f, stubval_t *args, stubval_t *res) \
+    { STUB_R_##kr(((STUB_T_##kr (*)(void)) f)()); }
+#define STUB_DEF1(kr, k1) \
+    static void stub_##kr##_##k1(void *f, stubval_t *args, stubval_t *res) \
+    { STUB_R_##kr(((STUB_T_##kr (*)(STUB_T_##k1)) f)(args[0].k1)); }
+#define STUB_DEF2(kr, k1, k2) \
+    static void stub_##kr##_##k1##k2(void *f, stubval_t *args, stubval_t *res) \
+    { STUB_R_##kr(((STUB_T_##kr (*)(STUB_T_##k1, STUB_T_##k2)) f)(args[0].k1, args[1].k2)); }
+#define STUB_DEF3(kr, k1, k2, k3) \
+    static void stub_##kr##_##k1##k2##k3(void *f, stubval_t *args, stubval_t *res) \
+    { STUB_R_##kr(((STUB_T_##kr (*)(STUB_T_##k1, STUB_T_##k2, STUB_T_##k3)) f)(args[0].k1, args[1].k2, args[2].k3)); }
+#define STUB_DEF4(kr, k1, k2, k3, k4) \
+    static void stub_##kr##_##k1##k2##k3##k4(void *f, stubval_t *args, stubval_t *res) \
+    { STUB_R_##kr(((STUB_T_##kr (*)(STUB_T_##k1, STUB_T_##k2, STUB_T_##k3, STUB_T_##k4)) f)(args[0].k1, args[1].k2, args[2].k3, args[3].k4)); }
+
+#define STUB_REF0(kr) stub_##kr##_,
+#define STUB_REF1(kr, k1) stub_##kr##_##k1,
+#define STUB_REF2(kr, k1, k2) stub_##kr##_##k1##k2,
+#define STUB_REF3(kr, k1, k2, k3) stub_##kr##_##k1##k2##k3,
+#define STUB_REF4(kr, k1, k2, k3, k4) stub_##kr##_##k1##k2##k3##k4,
+
+/* one copy per nesting level, a macro can't expand inside itself */
+#define STUB_EACH1(M, ...) M(__VA_ARGS__ i) M(__VA_ARGS__ p) M(__VA_ARGS__ d)
+#define STUB_EACH2(M, ...) M(__VA_ARGS__ i) M(__VA_ARGS__ p) M(__VA_ARGS__ d)
+#define STUB_EACH3(M, ...) M(__VA_ARGS__ i) M(__VA_ARGS__ p) M(__VA_ARGS__ d)
+#define STUB_EACH4(M, ...) M(__VA_ARGS__ i) M(__VA_ARGS__ p) M(__VA_ARGS__ d)
+
+#define STUB_ALL0(S, kr) S##0(kr)
+#define STUB_ALL1(S, kr) STUB_EACH1(S##1, kr,)
+#define STUB_ALL2_(S, kr, k1) STUB_EACH2(S##2, kr, k1,)
+#define STUB_ALL2(S, kr) STUB_EACH1(STUB_ALL2_, S, kr,)
+#define STUB_ALL3__(S, kr, k1, k2) STUB_EACH3(S##3, kr, k1, k2,)
+#define STUB_ALL3_(S, kr, k1) STUB_EACH2(STUB_ALL3__, S, kr, k1,)
+#define STUB_ALL3(S, kr) STUB_EACH1(STUB_ALL3_, S, kr,)
+#define STUB_ALL4___(S, kr, k1, k2, k3) STUB_EACH4(S##4, kr, k1, k2, k3,)
+#define STUB_ALL4__(S, kr, k1, k2) STUB_EACH3(STUB_ALL4___, S, kr, k1, k2,)
+#define STUB_ALL4_(S, kr, k1) STUB_EACH2(STUB_ALL4__, S, kr, k1,)
+#define STUB_ALL4(S, kr) STUB_EACH1(STUB_ALL4_, S, kr,)
+#define STUB_ALL(S, kr) \
+    STUB_ALL0(S, kr) STUB_ALL1(S, kr) STUB_ALL2(S, kr) STUB_ALL3(S, kr) STUB_ALL4(S, kr)
+
+STUB_ALL(STUB_DEF, v)
+STUB_ALL(STUB_DEF, i)
+STUB_ALL(STUB_DEF, p)
+STUB_ALL(STUB_DEF, d)
+
+/* indexed by return kind, then by the argument kinds read as a base 3
+ * number (int = 0, pointer = 1, double = 2) past the stubs of lower arity */
+static const stub_t stubs[4][1 + 3 + 9 + 27 + 81] = {
+    { STUB_ALL(STUB_REF, v) },
+    { STUB_ALL(STUB_REF, i) },
+    { STUB_ALL(STUB_REF, p) },
+    { STUB_ALL(STUB_REF, d) },
+};
+
+/* stub kind of a value type, 0 for int, 1 for pointer, 2 for double */
+static int stub_kind(int op, ffi_type *type)
+{
+    switch (op) {
+        case OP_INT:
+        case OP_SINT32:
+            return type->size == sizeof(int) ? 0 : -1;
+        case OP_POINTER:
+            return 1;
+        case OP_DOUBLE:
+            return 2;
+    }
+
+    return -1;
 }
 
-static int lua_struct_new(lua_State *L)
+static stub_t find_stub(cif_t *c)
 {
-    ffi_type *type;
-    int nargs = lua_gettop(L);
-    ffi_type **types;
-    int i;
+    static const int first[] = { 0, 1, 1 + 3, 1 + 3 + 9, 1 + 3 + 9 + 27 };
+    int i, k, rk, n = c->cif.nargs, index = 0;
 
-    if (nargs < 0)
-        return 0;
-    
-    type = lua_newuserdata(L, sizeof(ffi_type) + sizeof(ffi_type *) * (nargs + 1));
+    /* a variadic callee needs the vector register count that only the
+     * jit thunks and ffi_call pass */
+    if (c->variadic || c->cif.abi != FFI_DEFAULT_ABI || n > 4)
+        return NULL;
 
-    luaL_getmetatable(L, "ffi_type");
-    lua_setmetatable(L, -2);
+    if (c->rop == OP_VOID)
+        rk = 0;
+    else if ((rk = stub_kind(c->rop, c->cif.rtype)) < 0)
+        return NULL;
+    else
+        rk++;
+
+    for (i = 0; i < n; i++) {
+        if ((k = stub_kind(c->args[i].op, c->cif.arg_types[i])) < 0)
+            return NULL;
+        index = index * 3 + k;
+    }
+
+    return stubs[rk][first[n] + index];
+}
+
+/* x86-64 call thunks
+ *
+ * For signatures that have no stub, prep_cif compiles a small thunk that
+ * loads the marshaled arguments from the call frame into the SysV
+ * registers (spilling the rest on the stack), calls the target and
+ * stores the return value. The code lives in executable memory obtained
+ * from ffi_closure_alloc. Aggregates and long doubles are left to
+ * ffi_call. ffi.jit(false) turns the thunks off. */
 
-    types = (ffi_type **) (type + 1);
+static int jit_enabled = 1;
 
-    for (i = 0; i < nargs; i++)
-        types[i] = (ffi_type *) luaL_checkudata(L, i + 1, "ffi_type");
-    types[i] = NULL;
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(LUAFFI_NO_JIT)
 
-    type->type = FFI_TYPE_STRUCT;
-    type->alignment = type->size = 0;
-    type->elements = types;
+#define JIT_R11 11
 
-    return 1;
+static const int jit_intregs[] = { 7, 6, 2, 1, 8, 9 }; /* rdi rsi rdx rcx r8 r9 */
+
+static uint8_t *jit_imm32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+    return p + 4;
 }
 
-static int lua_ffi_call(lua_State *L)
+/* load the value of the given opcode at [rax + offset] into the integer
+ * register reg, widened to 32 or 64 bits */
+static uint8_t *jit_load_int(uint8_t *p, int op, int reg, size_t offset)
 {
-    ffi_cif *cif = lua_touserdata(L, 1);
-    void *f = lua_touserdata(L, 2);
-    int i, nargs = lua_gettop(L) - 2, j;
-    void **pargs, *arg;
-    void *rval;
-    uint8_t *ptr;
-    int sp;
+    int rexr = reg >= 8 ? 0x44 : 0;
 
-    /* commented out for efficiency purpose, anyway, we're supposed to know what we do here */
-    /*luaL_checkudata(L, 1, "ffi_cif");*/
-        
-    if (nargs > cif->nargs)
-        nargs = cif->nargs;
+    switch (op) {
+        case OP_SINT8:
+        case OP_UINT8:
+        case OP_SINT16:
+        case OP_UINT16:
+            if (rexr)
+                *p++ = rexr;
+            *p++ = 0x0f;
+            *p++ = op == OP_SINT8 ? 0xbe : op == OP_UINT8 ? 0xb6 : op == OP_SINT16 ? 0xbf : 0xb7;
+            break;
+        case OP_INT:
+        case OP_SINT32:
+        case OP_UINT32:
+        case OP_FLOAT:
+            if (rexr)
+                *p++ = rexr;
+            *p++ = 0x8b;
+            break;
+        default:
+            *p++ = 0x48 | rexr;
+            *p++ = 0x8b;
+            break;
+    }
+    *p++ = 0x80 | ((reg & 7) << 3);
+    return jit_imm32(p, offset);
+}
 
-    pargs = alloca(sizeof(void *) * nargs);
+/* movss/movsd xmm, [rax + offset] */
+static uint8_t *jit_load_sse(uint8_t *p, int op, int xmm, size_t offset)
+{
+    *p++ = op == OP_FLOAT ? 0xf3 : 0xf2;
+    *p++ = 0x0f;
+    *p++ = 0x10;
+    *p++ = 0x80 | (xmm << 3);
+    return jit_imm32(p, offset);
+}
 
-    for (i = 0, j = 3; i < nargs; i++, j++) {
-#       define putarg(type, val) ((pargs[i] = arg = alloca(sizeof(type))), *(type *)arg = (val))
-        switch (cif->arg_types[i]->type) {
-            case FFI_TYPE_INT:
-                putarg(int, lua_tonumber(L, j));
-                break;
-                
-            case FFI_TYPE_SINT8:
-                putarg(int8_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_SINT16:
-                putarg(int16_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_SINT32:
-                putarg(int32_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_SINT64:
-                putarg(int64_t, lua_tonumber(L, j));
-                break;
-                
-            case FFI_TYPE_UINT8:
-                putarg(uint8_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_UINT16:
-                putarg(uint16_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_UINT32:
-                putarg(uint32_t, lua_tonumber(L, j));
-                break;
-            case FFI_TYPE_UINT64:
-                putarg(uint64_t, lua_tonumber(L, j));
-                break;
-                
-#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
-            case FFI_TYPE_LONGDOUBLE:
-                putarg(long double, lua_tonumber(L, j));
-                break;
-#endif
-                
-            case FFI_TYPE_DOUBLE:
-                putarg(double, lua_tonumber(L, j));
-                break;
+static int jit_is_sse(int op)
+{
+    return op == OP_FLOAT || op == OP_DOUBLE;
+}
 
-            case FFI_TYPE_FLOAT:
-                putarg(float, lua_tonumber(L, j));
-                break;
+static int jit_supported(int op)
+{
+    return op != OP_STRUCT && op != OP_LONGDOUBLE;
+}
 
-            case FFI_TYPE_STRUCT:
-                pargs[i] = lua_touserdata(L, j);
-                break;
-                
-            case FFI_TYPE_POINTER:
-                if (lua_isstring(L, j))
-                    putarg(const char *, lua_tostring(L, j));
-                else
-                    putarg(void *, lua_touserdata(L, j));
-                break;
+#define JIT_MAXCODE(nargs) (64 + 16 * (nargs))
+
+static int jit_compile(cif_t *c)
+{
+    uint8_t *p, *code;
+    unsigned i, nargs = c->cif.nargs;
+    int nint = 0, nsse = 0, nstack = 0;
+    size_t stack;
+
+    if (c->code)
+        return 1;
+    if (c->cif.abi != FFI_DEFAULT_ABI || !jit_supported(c->rop))
+        return 0;
+
+    for (i = 0; i < nargs; i++) {
+        if (!jit_supported(c->args[i].op))
+            return 0;
+        if (jit_is_sse(c->args[i].op) ? nsse++ >= 8 : nint++ >= 6)
+            nstack++;
+    }
+
+    p = c->code = ffi_closure_alloc(JIT_MAXCODE(nargs), (void **) &code);
+    if (!p)
+        return 0;
+
+    /* push rbp; mov rbp, rsp; push rbx */
+    *p++ = 0x55;
+    *p++ = 0x48; *p++ = 0x89; *p++ = 0xe5;
+    *p++ = 0x53;
+    /* mov rbx, rdx (rval); mov r10, rdi (f); mov rax, rsi (frame) */
+    *p++ = 0x48; *p++ = 0x89; *p++ = 0xd3;
+    *p++ = 0x49; *p++ = 0x89; *p++ = 0xfa;
+    *p++ = 0x48; *p++ = 0x89; *p++ = 0xf0;
+    /* sub rsp, stack, keeping rsp 16 bytes aligned at the call */
+    stack = ALIGN(nstack * 8, 16) + 8;
+    *p++ = 0x48; *p++ = 0x81; *p++ = 0xec;
+    p = jit_imm32(p, stack);
+
+    nint = nsse = nstack = 0;
+    for (i = 0; i < nargs; i++) {
+        int op = c->args[i].op;
+        size_t offset = c->args[i].offset;
+
+        if (jit_is_sse(op) && nsse < 8)
+            p = jit_load_sse(p, op, nsse++, offset);
+        else if (!jit_is_sse(op) && nint < 6)
+            p = jit_load_int(p, op, jit_intregs[nint++], offset);
+        else {
+            /* through r11: mov [rsp + 8 * nstack], r11 */
+            p = jit_load_int(p, op, JIT_R11, offset);
+            *p++ = 0x4c; *p++ = 0x89; *p++ = 0x9c; *p++ = 0x24;
+            p = jit_imm32(p, 8 * nstack++);
         }
-#       undef putarg
     }
 
-    if (cif->rtype->type == FFI_TYPE_STRUCT) {
-        rval = lua_newuserdata(L, cif->rtype->size);
-        sp = lua_gettop(L);
-    } else
-        rval = alloca(cif->rtype->size);
+    /* mov al, nsse (vector register count for variadic callees); call r10 */
+    *p++ = 0xb0; *p++ = nsse;
+    *p++ = 0x41; *p++ = 0xff; *p++ = 0xd2;
 
-    ffi_call(cif, f, rval, pargs);
+    /* store the return value at [rbx] */
+    if (c->rop == OP_FLOAT || c->rop == OP_DOUBLE) {
+        *p++ = c->rop == OP_FLOAT ? 0xf3 : 0xf2;
+        *p++ = 0x0f; *p++ = 0x11; *p++ = 0x03;
+    } else if (c->rop != OP_VOID) {
+        *p++ = 0x48; *p++ = 0x89; *p++ = 0x03;
+    }
+
+    /* mov rbx, [rbp - 8]; leave; ret */
+    *p++ = 0x48; *p++ = 0x8b; *p++ = 0x5d; *p++ = 0xf8;
+    *p++ = 0xc9;
+    *p++ = 0xc3;
+
+    c->compiled = (thunk_t) code;
+
+    return 1;
+}
+
+static void jit_free(cif_t *c)
+{
+    if (c->code)
+        ffi_closure_free(c->code);
+    c->code = NULL;
+    c->thunk = c->compiled = NULL;
+}
+
+#else
+
+static int jit_compile(cif_t *c) { return 0; }
+static void jit_free(cif_t *c) { }
 
-    switch (cif->rtype->type) {
-        case FFI_TYPE_INT:
-            lua_pushnumber(L, *(int *) rval);
-            return 1;
-            
-        case FFI_TYPE_SINT8:
-            lua_pushnumber(L, *(int8_t *) rval);
-            return 1;
-        case FFI_TYPE_SINT16:
-            lua_pushnumber(L, *(int16_t *) rval);
-            return 1;
-        case FFI_TYPE_SINT32:
-            lua_pushnumber(L, *(int32_t *) rval);
-            return 1;
-        case FFI_TYPE_SINT64:
-            lua_pushnumber(L, *(int64_t *) rval);
-            return 1;
-            
-        case FFI_TYPE_UINT8:
-            lua_pushnumber(L, *(uint8_t *) rval);
-            return 1;
-        case FFI_TYPE_UINT16:
-            lua_pushnumber(L, *(uint16_t *) rval);
-            return 1;
-        case FFI_TYPE_UINT32:
-            lua_pushnumber(L, *(uint32_t *) rval);
-            return 1;
-        case FFI_TYPE_UINT64:
-            lua_pushnumber(L, *(uint64_t *) rval);
-            return 1;
-            
-#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
-        case FFI_TYPE_LONGDOUBLE:
-            lua_pushnumber(L, *(long double *) rval);
-            return 1;
 #endif
-        case FFI_TYPE_DOUBLE:
-            lua_pushnumber(L, *(double *) rval);
-            return 1;
-        case FFI_TYPE_FLOAT:
-            lua_pushnumber(L, *(float *) rval);
-            return 1;
 
-        case FFI_TYPE_STRUCT:
-            /* the result is already in the stack */
-            lua_settop(L, sp);
-            return 1;
-            
-        case FFI_TYPE_POINTER:
-            lua_pushlightuserdata(L, *(void * *) rval);
-            return 1;
-    }
+/* reserve a slot of at least one ffi_arg for a value of the given type */
+static size_t plan_slot(size_t *frame, ffi_type *type)
+{
+    size_t align = type->alignment > sizeof(ffi_arg) ? type->alignment : sizeof(ffi_arg);
+    size_t size = type->size > sizeof(ffi_arg) ? type->size : sizeof(ffi_arg);
+    size_t offset = ALIGN(*frame, align);
 
-    return 0;
+    *frame = offset + size;
+
+    return offset;
 }
 
-static stringreg_t cif_metastrings[] = {
-    { "type", "ffi_cif" },
-    NULL
-};
+/* must be called after ffi_prep_cif, which computes the struct sizes */
+static void plan_cif(cif_t *c)
+{
+    size_t frame = 0;
+    unsigned i;
+    int n = 0;
 
-static stringreg_t type_metastrings[] = {
-    { "type", "ffi_type" },
-    NULL
-};
+    c->nouts = 0;
+    for (i = 0; i < c->cif.nargs; i++) {
+        ffi_type *type = c->cif.arg_types[i];
+        argplan_t *a = &c->args[i];
 
+        a->op = type_op(type);
+        a->offset = plan_slot(&frame, type);
+        a->larg = a->op == OP_LSTRLEN ? n - 1 : n;
+        if (a->op == OP_OUT) {
+            a->top = type_op(type->elements[0]);
+            a->inout = OUTTYPE(type)->inout;
+            a->toffset = plan_slot(&frame, type->elements[0]);
+            c->nouts++;
+            n += a->inout;
+        } else if (a->op != OP_LSTRLEN)
+            n++;
+    }
+    c->nlargs = n;
 
-/* closures */
+    c->rop = type_op(c->cif.rtype);
+    c->roffset = plan_slot(&frame, c->cif.rtype);
+    c->frame = ALIGN(frame, sizeof(void *));
+    c->stub = find_stub(c);
+
+    c->thunk = c->compiled = NULL;
+    c->code = NULL;
+    if (!c->stub && jit_enabled && jit_compile(c))
+        c->thunk = c->compiled;
+}
+
+/* 64 bit integers
+ *
+ * A double holds integers exactly up to 2^53, so 64 bit values beyond it
+ * are boxed in an "ffi_int64" userdata, a signed or unsigned int64 with
+ * arithmetic and comparison metamethods. Values that fit a double are
+ * pushed as plain numbers, which is the common case and costs no
+ * allocation, and boxes are accepted wherever a 64 bit integer is
+ * expected, as are numbers and decimal or hex strings. With Lua 5.3 and
+ * later, lua_Integer is 64 bits and no boxes are needed. */
+
+#define INT64_EXACT ((int64_t) 1 << 53)
 
 typedef struct {
-    lua_State *L;
-    ffi_closure *writable;
-    void *f;
-} closure_t;
+    int64_t v;
+    int u;                      /* unsigned */
+} int64box_t;
 
-static void lua_ffi_closure(ffi_cif *cif, void *resp, void **args,
-                            void *userdata)
+/* whether the value at idx is a userdata of the metatable tname */
+static int is_udata(lua_State *L, int idx, const char *tname)
 {
-    closure_t *c = (closure_t *) userdata;
-    lua_State *L = c->L;
-    int i;
-    int sp = lua_gettop(L);
+    int res;
 
-    luaL_getmetatable(L, "ffi_closure");
-    lua_pushlightuserdata(L, c);
-    lua_rawget(L, -2);
+    if (!lua_getmetatable(L, idx))
+        return 0;
+    luaL_getmetatable(L, tname);
+    res = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
 
-    for (i = 0; i < cif->nargs; i++) {
-        void *arg = args[i];
-        
-        switch (cif->arg_types[i]->type) {
-        case FFI_TYPE_INT:
-            lua_pushnumber(L, *(int *) arg);
-            break;
-            
-        case FFI_TYPE_SINT8:
-            lua_pushnumber(L, *(int8_t *) arg);
-            break;
-        case FFI_TYPE_SINT16:
-            lua_pushnumber(L, *(int16_t *) arg);
-            break;
-        case FFI_TYPE_SINT32:
-            lua_pushnumber(L, *(int32_t *) arg);
-            break;
-        case FFI_TYPE_SINT64:
-            lua_pushnumber(L, *(int64_t *) arg);
-            break;
-            
-        case FFI_TYPE_UINT8:
-            lua_pushnumber(L, *(uint8_t *) arg);
-            break;
-        case FFI_TYPE_UINT16:
-            lua_pushnumber(L, *(uint16_t *) arg);
-            break;
-        case FFI_TYPE_UINT32:
-            lua_pushnumber(L, *(uint32_t *) arg);
-            break;
-        case FFI_TYPE_UINT64:
-            lua_pushnumber(L, *(uint64_t *) arg);
-            break;
-            
-#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
-        case FFI_TYPE_LONGDOUBLE:
-            lua_pushnumber(L, *(long double *) arg);
-            break;
-#endif
-        case FFI_TYPE_DOUBLE:
-            lua_pushnumber(L, *(double *) arg);
-            break;
-        case FFI_TYPE_FLOAT:
-            lua_pushnumber(L, *(float *) arg);
-            break;
+    return res;
+}
 
-        case FFI_TYPE_STRUCT:
-            lua_pushlightuserdata(L, arg);
-            break;
-            
-        case FFI_TYPE_POINTER:
-            lua_pushlightuserdata(L, *(void * *) arg);
-            break;
-        }
+static int64box_t *test_int64(lua_State *L, int idx)
+{
+    void *p = lua_touserdata(L, idx);
+
+    return p && is_udata(L, idx, "ffi_int64") ? p : NULL;
+}
+
+static void push_int64(lua_State *L, int64_t v, int u)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer) v);
+#else
+    if (u ? (uint64_t) v <= (uint64_t) INT64_EXACT : v >= -INT64_EXACT && v <= INT64_EXACT)
+        lua_pushnumber(L, u ? (lua_Number) (uint64_t) v : (lua_Number) v);
+    else {
+        int64box_t *b = lua_newuserdata(L, sizeof(int64box_t));
+
+        b->v = v;
+        b->u = u;
+        luaL_getmetatable(L, "ffi_int64");
+        lua_setmetatable(L, -2);
     }
-    
-    lua_call(L, cif->nargs, cif->rtype->type == FFI_TYPE_VOID? 0 : 1);
+#endif
+}
 
-#   define putres(type, val) (*(type *)resp = (val))
-    switch (cif->rtype->type) {
-        case FFI_TYPE_INT:
-            putres(int, lua_tonumber(L, -1));
-            break;
-            
-        case FFI_TYPE_SINT8:
-            putres(int8_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_SINT16:
-            putres(int16_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_SINT32:
-            putres(int32_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_SINT64:
-            putres(int64_t, lua_tonumber(L, -1));
-            break;
-            
-        case FFI_TYPE_UINT8:
-            putres(uint8_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_UINT16:
-            putres(uint16_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_UINT32:
-            putres(uint32_t, lua_tonumber(L, -1));
-            break;
-        case FFI_TYPE_UINT64:
-            putres(uint64_t, lua_tonumber(L, -1));
-            break;
-            
-#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
-        case FFI_TYPE_LONGDOUBLE:
-            putres(long double, lua_tonumber(L, -1));
-            break;
+/* the 64 bit integer at idx, *u is set for unsigned boxes and numbers
+ * past INT64_MAX. Numbers out of range, NaN and strings that aren't
+ * integers raise an error */
+static int64_t to_int64(lua_State *L, int idx, int *u)
+{
+    int64box_t *b;
+    lua_Number d;
+    uint64_t v;
+    const char *s;
+    char *end;
+    int dummy;
+
+    if (!u)
+        u = &dummy;
+    *u = 0;
+
+    switch (lua_type(L, idx)) {
+        case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+            if (lua_isinteger(L, idx))
+                return lua_tointeger(L, idx);
 #endif
-            
-        case FFI_TYPE_DOUBLE:
-            putres(double, lua_tonumber(L, -1));
-            break;
-            
-        case FFI_TYPE_FLOAT:
-            putres(float, lua_tonumber(L, -1));
-            break;
-            
-        case FFI_TYPE_STRUCT:
-            memcpy(resp, lua_touserdata(L, -1), cif->rtype->size);
+            d = lua_tonumber(L, idx);
+            /* false for NaN too */
+            if (!(d >= -9223372036854775808.0 && d < 18446744073709551616.0))
+                luaL_error(L, "number out of 64 bit integer range");
+            if (d >= 9223372036854775808.0) {
+                *u = 1;
+                return (int64_t) (uint64_t) d;
+            }
+            return (int64_t) d;
+
+        case LUA_TSTRING:
+            s = lua_tostring(L, idx);
+            while (*s == ' ')
+                s++;
+            errno = 0;
+            if (*s == '-')
+                v = strtoll(s, &end, 0);
+            else {
+                v = strtoull(s, &end, 0);
+                *u = v > INT64_MAX;
+            }
+            while (*end == ' ')
+                end++;
+            if (end == s || *end || errno)
+                luaL_error(L, "invalid 64 bit integer '%s'", lua_tostring(L, idx));
+            return v;
+
+        case LUA_TUSERDATA:
+            if ((b = test_int64(L, idx))) {
+                *u = b->u;
+                return b->v;
+            }
+            /* fall through */
+        default:
+            return 0;
+    }
+}
+
+/* the size argument at idx */
+static size_t checksize(lua_State *L, int idx)
+{
+    int64_t n;
+
+    luaL_checkany(L, idx);
+    n = to_int64(L, idx, NULL);
+    luaL_argcheck(L, n >= 0, idx, "size expected");
+    return n;
+}
+
+/* the optional offset argument at idx */
+static size_t optsize(lua_State *L, int idx)
+{
+    return lua_isnoneornil(L, idx) ? 0 : checksize(L, idx);
+}
+
+/* ffi.int64(v) and ffi.uint64(v) box v, to keep computing in 64 bits */
+static int int64_new(lua_State *L, int u)
+{
+    int64box_t *b;
+    int64_t v = to_int64(L, 1, NULL);
+
+    b = lua_newuserdata(L, sizeof(int64box_t));
+    b->v = v;
+    b->u = u;
+    luaL_getmetatable(L, "ffi_int64");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int lua_int64(lua_State *L)
+{
+    return int64_new(L, 0);
+}
+
+static int lua_uint64(lua_State *L)
+{
+    return int64_new(L, 1);
+}
+
+/* ffi.tonumber(v) converts a 64 bit integer to the nearest double */
+static int lua_ffi_tonumber(lua_State *L)
+{
+    int u;
+    int64_t v = to_int64(L, 1, &u);
+
+    lua_pushnumber(L, u ? (lua_Number) (uint64_t) v : (lua_Number) v);
+    return 1;
+}
+
+/* arithmetic wraps around as in C, the result is unsigned if either
+ * operand is, and stays boxed */
+static int int64_arith(lua_State *L, int op)
+{
+    int ua, ub;
+    uint64_t a = to_int64(L, 1, &ua), b = to_int64(L, 2, &ub), r = 0;
+    int u = ua || ub;
+    int64box_t *box;
+
+    if ((op == '/' || op == '%') && b == 0)
+        return luaL_error(L, "integer division by zero");
+
+    switch (op) {
+        case '+': r = a + b; break;
+        case '-': r = a - b; break;
+        case '*': r = a * b; break;
+        case '/':
+            if (u)
+                r = a / b;
+            else if ((int64_t) b == -1)
+                r = -a;
+            else
+                r = (int64_t) a / (int64_t) b;
             break;
-            
-        case FFI_TYPE_POINTER:
-            if (lua_isstring(L, -1))
-                putres(const char *, lua_tostring(L, -1));
+        case '%':
+            if (u)
+                r = a % b;
+            else if ((int64_t) b == -1)
+                r = 0;
             else
-                putres(void *, lua_touserdata(L, -1));
+                r = (int64_t) a % (int64_t) b;
             break;
+        case 'u': r = -a; break;
     }
-#   undef putres
 
-    /* restore stack balance */
-    lua_settop(L, sp);
-}
+    box = lua_newuserdata(L, sizeof(int64box_t));
+    box->v = r;
+    box->u = u;
+    luaL_getmetatable(L, "ffi_int64");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+static int lua_int64_add(lua_State *L) { return int64_arith(L, '+'); }
+static int lua_int64_sub(lua_State *L) { return int64_arith(L, '-'); }
+static int lua_int64_mul(lua_State *L) { return int64_arith(L, '*'); }
+static int lua_int64_div(lua_State *L) { return int64_arith(L, '/'); }
+static int lua_int64_mod(lua_State *L) { return int64_arith(L, '%'); }
+static int lua_int64_unm(lua_State *L) { return int64_arith(L, 'u'); }
+
+/* -1 if a < b, 0 if a == b, 1 if a > b, unsigned if either is */
+static int int64_compare(lua_State *L)
+{
+    int ua, ub;
+    int64_t a = to_int64(L, 1, &ua), b = to_int64(L, 2, &ub);
+
+    if (ua || ub)
+        return (uint64_t) a < (uint64_t) b ? -1 : a != b;
+    return a < b ? -1 : a != b;
+}
+
+static int lua_int64_eq(lua_State *L)
+{
+    lua_pushboolean(L, int64_compare(L) == 0);
+    return 1;
+}
+
+static int lua_int64_lt(lua_State *L)
+{
+    lua_pushboolean(L, int64_compare(L) < 0);
+    return 1;
+}
+
+static int lua_int64_le(lua_State *L)
+{
+    lua_pushboolean(L, int64_compare(L) <= 0);
+    return 1;
+}
+
+static int lua_int64_tostring(lua_State *L)
+{
+    int64box_t *b = lua_touserdata(L, 1);
+    char buf[24];
+
+    if (b->u)
+        sprintf(buf, "%llu", (unsigned long long) b->v);
+    else
+        sprintf(buf, "%lld", (long long) b->v);
+    lua_pushstring(L, buf);
+
+    return 1;
+}
+
+static funcreg_t int64_metafuncs[] = {
+    { "__add", lua_int64_add },
+    { "__sub", lua_int64_sub },
+    { "__mul", lua_int64_mul },
+    { "__div", lua_int64_div },
+    { "__mod", lua_int64_mod },
+    { "__unm", lua_int64_unm },
+    { "__eq", lua_int64_eq },
+    { "__lt", lua_int64_lt },
+    { "__le", lua_int64_le },
+    { "__tostring", lua_int64_tostring },
+    NULL
+};
+static stringreg_t int64_metastrings[] = {
+    { "type", "ffi_int64" },
+    NULL
+};
+
+/* handle of an ffi.new block, see the memory arenas */
+typedef struct {
+    void *ptr;
+    size_t size;
+    int cls;                    /* slab size class, past the last if malloc'd alone */
+} cdata_t;
+
+/* the memory a pointer argument at idx stands for: the block of an
+ * ffi.new handle, else the userdata itself, or NULL */
+static void *toptr(lua_State *L, int idx)
+{
+    cdata_t *c = lua_touserdata(L, idx);
+
+    if (c && lua_type(L, idx) == LUA_TUSERDATA && lua_objlen(L, idx) == sizeof(cdata_t)
+        && is_udata(L, idx, "ffi_cdata"))
+        return c->ptr;
+    return c;
+}
+
+/* the pointer at idx and the size known for it, that of a buffer or of
+ * the block of an ffi.new handle, (size_t) -1 for a lightuserdata */
+static uint8_t *tomem(lua_State *L, int idx, size_t *size)
+{
+    uint8_t *p = toptr(L, idx);
+
+    *size = (size_t) -1;
+    if (lua_type(L, idx) == LUA_TUSERDATA)
+        *size = p != lua_touserdata(L, idx) ? ((cdata_t *) lua_touserdata(L, idx))->size
+                                            : lua_objlen(L, idx);
+    return p;
+}
+
+/* convert the lua value at idx to a C value of the given opcode */
+static void to_c(lua_State *L, int idx, int op, void *dst)
+{
+    switch (op) {
+        case OP_INT: *(int *) dst = lua_tonumber(L, idx); break;
+        case OP_SINT8: *(int8_t *) dst = lua_tonumber(L, idx); break;
+        case OP_SINT16: *(int16_t *) dst = lua_tonumber(L, idx); break;
+        case OP_SINT32: *(int32_t *) dst = lua_tonumber(L, idx); break;
+        case OP_SINT64: *(int64_t *) dst = to_int64(L, idx, NULL); break;
+        case OP_UINT8: *(uint8_t *) dst = lua_tonumber(L, idx); break;
+        case OP_UINT16: *(uint16_t *) dst = lua_tonumber(L, idx); break;
+        case OP_UINT32: *(uint32_t *) dst = lua_tonumber(L, idx); break;
+        case OP_UINT64: *(uint64_t *) dst = to_int64(L, idx, NULL); break;
+        case OP_FLOAT: *(float *) dst = lua_tonumber(L, idx); break;
+        case OP_DOUBLE: *(double *) dst = lua_tonumber(L, idx); break;
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+        case OP_LONGDOUBLE: *(long double *) dst = lua_tonumber(L, idx); break;
+#endif
+        case OP_POINTER:
+            if (lua_isstring(L, idx))
+                *(const char **) dst = lua_tostring(L, idx);
+            else
+                *(void **) dst = toptr(L, idx);
+            break;
+        case OP_LSTRLEN: *(size_t *) dst = lua_objlen(L, idx); break;
+    }
+}
+
+/* push the C value of the given opcode found at src */
+static void push_c(lua_State *L, int op, const void *src)
+{
+    switch (op) {
+        case OP_INT: lua_pushnumber(L, *(int *) src); break;
+        case OP_SINT8: lua_pushnumber(L, *(int8_t *) src); break;
+        case OP_SINT16: lua_pushnumber(L, *(int16_t *) src); break;
+        case OP_SINT32: lua_pushnumber(L, *(int32_t *) src); break;
+        case OP_SINT64: push_int64(L, *(int64_t *) src, 0); break;
+        case OP_UINT8: lua_pushnumber(L, *(uint8_t *) src); break;
+        case OP_UINT16: lua_pushnumber(L, *(uint16_t *) src); break;
+        case OP_UINT32: lua_pushnumber(L, *(uint32_t *) src); break;
+        case OP_UINT64: push_int64(L, *(uint64_t *) src, 1); break;
+        case OP_FLOAT: lua_pushnumber(L, *(float *) src); break;
+        case OP_DOUBLE: lua_pushnumber(L, *(double *) src); break;
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+        case OP_LONGDOUBLE: lua_pushnumber(L, *(long double *) src); break;
+#endif
+        case OP_STRUCT: lua_pushlightuserdata(L, (void *) src); break;
+        case OP_POINTER:
+        case OP_OUT: lua_pushlightuserdata(L, *(void * *) src); break;
+        case OP_LSTRLEN: lua_pushnumber(L, *(size_t *) src); break;
+    }
+}
+
+/* point the out arguments of c at their values in frame, zeroed or set
+ * from the lua arguments starting at base */
+static void outs_to_c(lua_State *L, cif_t *c, uint8_t *frame, int base)
+{
+    unsigned i;
+
+    for (i = 0; i < c->cif.nargs; i++) {
+        argplan_t *a = &c->args[i];
+        ffi_type *type;
+        void *src;
+
+        if (a->op != OP_OUT)
+            continue;
+        type = c->cif.arg_types[i]->elements[0];
+        *(void **) (frame + a->offset) = frame + a->toffset;
+        if (!a->inout)
+            memset(frame + a->toffset, 0, type->size);
+        else if (a->top != OP_STRUCT)
+            to_c(L, base + a->larg, a->top, frame + a->toffset);
+        else if ((src = toptr(L, base + a->larg)))
+            memcpy(frame + a->toffset, src, type->size);
+        else
+            memset(frame + a->toffset, 0, type->size);
+    }
+}
+
+/* push the out values of c in frame, a struct as a new userdata */
+static int push_outs(lua_State *L, cif_t *c, uint8_t *frame)
+{
+    unsigned i;
+
+    luaL_checkstack(L, c->nouts, "too many results");
+    for (i = 0; i < c->cif.nargs; i++) {
+        argplan_t *a = &c->args[i];
+        size_t size;
+
+        if (a->op != OP_OUT)
+            continue;
+        if (a->top == OP_STRUCT) {
+            size = c->cif.arg_types[i]->elements[0]->size;
+            memcpy(lua_newuserdata(L, size), frame + a->toffset, size);
+        } else
+            push_c(L, a->top, frame + a->toffset);
+    }
+
+    return c->nouts;
+}
+
+
+/* cifs are interned: identical signatures share one cif, and thus one
+ * plan and one thunk. The cache is a weak valued table in the registry
+ * keyed by the abi and type pointers, a cif keeps its types alive through
+ * its environment, so the pointers in a live key are never reused. */
+
+static char cif_cache_key;
+
+static struct {
+    size_t cif_hits, cif_misses;
+    size_t var_hits, var_misses;
+    size_t lib_opens, lib_hits, lib_closes, libs;   /* under dl_lock */
+    size_t slabs;                                   /* under slab_lock */
+} stats;
+
+static int by_value(ffi_type *type);
+
+/* push the cif of the abi at base, return type at base + 1 and argument
+ * types from base + 2 to the top, the first nfixed of which are fixed for
+ * a variadic cif, or nfixed is -1 */
+static int new_cif(lua_State *L, int base, int nfixed)
+{
+    cif_t *c;
+    int tbase = base + 2, nargs = lua_gettop(L) - tbase + 1;
+    int nkey = nargs + 2 + (nfixed >= 0);
+    ffi_type **types;
+    ffi_status status;
+    void **key;
+    int i, n, nl = 0, nlfixed = 0;
+
+    if (nargs < 0)
+        return 0;
+
+    key = alloca(sizeof(void *) * nkey);
+    key[0] = lua_touserdata(L, base);
+    key[1] = luaL_checkudata(L, base + 1, "ffi_type");
+    if (((ffi_type *) key[1])->type == TYPE_LSTRING || type_op(key[1]) == OP_OUT)
+        return 0;
+    luaL_argcheck(L, by_value(key[1]), base + 1, "union or packed struct returned by value");
+    for (i = 0; i < nargs; i++) {
+        key[i + 2] = luaL_checkudata(L, tbase + i, "ffi_type");
+        luaL_argcheck(L, by_value(key[i + 2]), tbase + i, "union or packed struct passed by value");
+        if (((ffi_type *) key[i + 2])->type == TYPE_LSTRING) {
+            nl++;
+            nlfixed += i < nfixed;
+        }
+    }
+    if (nfixed >= 0)
+        key[nargs + 2] = (void *) (intptr_t) nfixed;
+
+    lua_pushlightuserdata(L, &cif_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlstring(L, (const char *) key, sizeof(void *) * nkey);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_touserdata(L, -1)) {
+        stats.cif_hits++;
+        return 1;
+    }
+    lua_pop(L, 1);
+    stats.cif_misses++;
+    
+    n = nargs + nl;
+    c = lua_newuserdata(L, sizeof(cif_t) + (sizeof(argplan_t) + sizeof(ffi_type *)) * n);
+
+    luaL_getmetatable(L, "ffi_cif");
+    lua_setmetatable(L, -2);
+
+    c->code = NULL;             /* until planned, for __gc */
+    c->variadic = nfixed >= 0;
+    c->args = (argplan_t *) (c + 1);
+    types = (ffi_type **) (c->args + n);
+
+    lua_createtable(L, nargs + 1, 0);
+    lua_pushvalue(L, base + 1);
+    lua_rawseti(L, -2, 1);
+    for (i = 0; i < nargs; i++) {
+        lua_pushvalue(L, tbase + i);
+        lua_rawseti(L, -2, i + 2);
+    }
+    lua_setfenv(L, -2);
+
+    for (i = 0, n = 0; i < nargs; i++) {
+        if (((ffi_type *) key[i + 2])->type != TYPE_LSTRING)
+            types[n++] = key[i + 2];
+        else {
+            types[n++] = &ffi_type_pointer;
+            types[n++] = &type_lstrlen;
+        }
+    }
+
+    if (nfixed >= 0)
+        status = ffi_prep_cif_var(&c->cif, (ffi_abi) key[0], nfixed + nlfixed, n, key[1], types);
+    else
+        status = ffi_prep_cif(&c->cif, (ffi_abi) key[0], n, key[1], types);
+    if (status != FFI_OK)
+        return 0;
+
+    plan_cif(c);
+
+    /* cache[key] = cif */
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -5);
+
+    return 1;
+}
+
+static int lua_prep_cif(lua_State *L)
+{
+    return new_cif(L, 1, -1);
+}
+
+/* ffi.prep_cif_var(abi, rtype, nfixed, argtypes...) */
+static int lua_prep_cif_var(lua_State *L)
+{
+    int nfixed = luaL_checkint(L, 3);
+
+    luaL_argcheck(L, nfixed >= 0 && nfixed <= lua_gettop(L) - 3, 3,
+                  "invalid number of fixed arguments");
+    lua_remove(L, 3);
+
+    return new_cif(L, 1, nfixed);
+}
+
+/* out types are interned like cifs, in a weak valued table keyed by the
+ * type of the value and the mode */
+static char out_cache_key;
+
+static int out_type(lua_State *L, int inout)
+{
+    ffi_type *type = luaL_checkudata(L, 1, "ffi_type");
+    outtype_t *o;
+    void *key[2];
+
+    luaL_argcheck(L, type->type != FFI_TYPE_VOID && type->type != TYPE_LSTRING
+                  && type_op(type) != OP_OUT, 1, "value type expected");
+
+    key[0] = type;
+    key[1] = (void *) (intptr_t) inout;
+    lua_pushlightuserdata(L, &out_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlstring(L, (const char *) key, sizeof(key));
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (lua_touserdata(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    o = lua_newuserdata(L, sizeof(outtype_t));
+    o->type = ffi_type_pointer;
+    o->type.elements = o->elements;
+    o->elements[0] = type;
+    o->elements[1] = NULL;
+    o->inout = inout;
+    luaL_getmetatable(L, "ffi_type");
+    lua_setmetatable(L, -2);
+
+    /* keep the type of the value alive */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -5);
+    return 1;
+}
+
+/* ffi.Tout(type) is an argument type passing a pointer to a value of
+ * type, returned after the return value, ffi.Tinout(type) also takes the
+ * value as an argument */
+static int lua_out_type(lua_State *L)
+{
+    return out_type(L, 0);
+}
+
+static int lua_inout_type(lua_State *L)
+{
+    return out_type(L, 1);
+}
+
+/* ffi.stats() returns the counters of the caches */
+static int lua_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 9);
+    lua_pushnumber(L, stats.cif_hits);
+    lua_setfield(L, -2, "cif_hits");
+    lua_pushnumber(L, stats.cif_misses);
+    lua_setfield(L, -2, "cif_misses");
+    lua_pushnumber(L, stats.var_hits);
+    lua_setfield(L, -2, "var_hits");
+    lua_pushnumber(L, stats.var_misses);
+    lua_setfield(L, -2, "var_misses");
+    lua_pushnumber(L, stats.lib_opens);
+    lua_setfield(L, -2, "lib_opens");
+    lua_pushnumber(L, stats.lib_hits);
+    lua_setfield(L, -2, "lib_hits");
+    lua_pushnumber(L, stats.lib_closes);
+    lua_setfield(L, -2, "lib_closes");
+    lua_pushnumber(L, stats.libs);
+    lua_setfield(L, -2, "libs");
+    lua_pushnumber(L, stats.slabs);
+    lua_setfield(L, -2, "slabs");
+
+    return 1;
+}
+
+/* struct, union and array types
+ *
+ * The layout is computed up front: every field records its offset and
+ * opcode, and the struct's size and alignment are set so that libffi
+ * doesn't have to compute them again. The environment table of a struct
+ * type maps field names to field numbers and keeps the field types
+ * alive at their field number.
+ *
+ * Layouts follow GCC: union members all sit at offset 0, pack = n caps
+ * the alignment of the members like #pragma pack(n) (pack = 1 is
+ * __attribute__((packed))), align = n raises the alignment of the whole
+ * type like __attribute__((aligned(n))). An array is described to libffi
+ * as a struct of its elements (one, past ARRAY_ELEMENTS bytes) and has
+ * a single field, its element.
+ * libffi knows nothing of unions and packing, such types are accessed in
+ * place or through pointers, and cifs refuse them by value. */
+
+enum {
+    KIND_STRUCT,
+    KIND_UNION,
+    KIND_ARRAY
+};
+
+typedef struct {
+    ffi_type *type;
+    int op;
+    size_t offset;
+} field_t;
+
+typedef struct {
+    ffi_type type;              /* must come first, a struct_t is also an ffi_type */
+    int kind;
+    size_t count;               /* number of elements of an array */
+    size_t pack, align;         /* 0 when not given */
+    int nfields;
+    field_t *fields;
+} struct_t;
+
+/* push a new aggregate type of nfields fields to fill with struct_setfield,
+ * and nelements libffi elements */
+static struct_t *struct_alloc(lua_State *L, int kind, int nfields, size_t nelements)
+{
+    struct_t *s = lua_newuserdata(L, sizeof(struct_t) + sizeof(field_t) * nfields +
+                                  sizeof(ffi_type *) * (nelements + 1));
+
+    luaL_getmetatable(L, "ffi_type");
+    lua_setmetatable(L, -2);
+    lua_createtable(L, nfields, nfields);
+    lua_setfenv(L, -2);
+
+    s->kind = kind;
+    s->count = nfields;
+    s->pack = s->align = 0;
+    s->nfields = nfields;
+    s->fields = (field_t *) (s + 1);
+    s->type.type = FFI_TYPE_STRUCT;
+    s->type.alignment = s->type.size = 0;
+    s->type.elements = (ffi_type **) (s->fields + nfields);
+    s->type.elements[nelements] = NULL;
+
+    return s;
+}
+
+static void struct_setfield(struct_t *s, int i, ffi_type *type)
+{
+    s->fields[i].type = s->type.elements[i] = type;
+    s->fields[i].op = type_op(type);
+}
+
+static void struct_layout(struct_t *s)
+{
+    size_t offset = 0, size = 0, align = 1;
+    int i, largest = 0;
+
+    for (i = 0; i < s->nfields; i++) {
+        ffi_type *type = s->fields[i].type;
+        size_t a = s->pack && type->alignment > s->pack ? s->pack : type->alignment;
+
+        if (s->kind == KIND_UNION) {
+            s->fields[i].offset = 0;
+            if (type->size > size)
+                size = type->size, largest = i;
+        } else {
+            offset = ALIGN(offset, a);
+            s->fields[i].offset = offset;
+            size = offset += type->size;
+        }
+        if (a > align)
+            align = a;
+    }
+
+    if (s->align > align)
+        align = s->align;
+
+    if (s->kind == KIND_UNION && s->nfields) {
+        s->type.elements[0] = s->fields[largest].type;
+        s->type.elements[1] = NULL;
+    }
+
+    s->type.alignment = align;
+    s->type.size = ALIGN(size, align);
+}
+
+/* libffi classifies a struct passed by value by its elements alone, which
+ * says nothing of unions, pack or align: such types can't be passed */
+static int by_value(ffi_type *type)
+{
+    struct_t *s = (struct_t *) type;
+    size_t natural = 1;
+    int i;
+
+    if (type->type != FFI_TYPE_STRUCT)
+        return 1;
+    if (s->kind == KIND_UNION)
+        return 0;
+    for (i = 0; i < s->nfields; i++) {
+        if (!by_value(s->fields[i].type))
+            return 0;
+        if (s->fields[i].type->alignment > natural)
+            natural = s->fields[i].type->alignment;
+    }
+
+    return type->alignment == natural;
+}
+
+/* void, or a type of no alignment, can't be a field or element: it would
+ * break ALIGN. Of the types of no size only zero length arrays can, for
+ * flexible array members */
+static int field_ok(ffi_type *type)
+{
+    return type->type != FFI_TYPE_VOID && type->alignment &&
+        (type->size || (type->type == FFI_TYPE_STRUCT && ((struct_t *) type)->kind == KIND_ARRAY));
+}
+
+static struct_t *check_struct(lua_State *L, int idx)
+{
+    ffi_type *type = luaL_checkudata(L, idx, "ffi_type");
+
+    luaL_argcheck(L, type->type == FFI_TYPE_STRUCT, idx, "struct type expected");
+    return (struct_t *) type;
+}
+
+/* field number of the name or number at idx in the struct at sidx, or 0 */
+static int struct_field(lua_State *L, int sidx, int idx)
+{
+    int i;
+
+    if (lua_type(L, idx) == LUA_TNUMBER)
+        i = lua_tointeger(L, idx);
+    else {
+        lua_getfenv(L, sidx);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, -2);
+        i = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    }
+
+    return i >= 1 && i <= ((struct_t *) lua_touserdata(L, sidx))->nfields ? i : 0;
+}
+
+/* ffi.struct_new([options,] [name,] type, [name,] type, ...), a name
+ * before a type names that field, options is a { pack = n, align = n }
+ * table */
+static int aggregate_new(lua_State *L, int kind)
+{
+    int nargs = lua_gettop(L);
+    int i, n, first = 1, nfields = 0;
+    size_t pack = 0, align = 0;
+    struct_t *s;
+
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "pack");
+        lua_getfield(L, 1, "align");
+        pack = lua_tointeger(L, -2);
+        align = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+        first = 2;
+    }
+
+    for (i = first; i <= nargs; i++)
+        if (lua_type(L, i) != LUA_TSTRING)
+            nfields++;
+
+    s = struct_alloc(L, kind, nfields, nfields);
+    s->pack = pack;
+    s->align = align;
+    lua_getfenv(L, -1);
+
+    for (i = first, n = 0; i <= nargs; i++) {
+        if (lua_type(L, i) == LUA_TSTRING) {
+            luaL_argcheck(L, i < nargs && lua_type(L, i + 1) != LUA_TSTRING, i, "field type expected");
+            lua_pushvalue(L, i);
+            lua_pushinteger(L, n + 1);
+            lua_rawset(L, -3);
+            continue;
+        }
+
+        struct_setfield(s, n, (ffi_type *) luaL_checkudata(L, i, "ffi_type"));
+        luaL_argcheck(L, field_ok(s->fields[n].type), i, "invalid field type");
+        /* keep the field type alive */
+        lua_pushvalue(L, i);
+        lua_rawseti(L, -2, ++n);
+    }
+
+    lua_pop(L, 1);
+    struct_layout(s);
+
+    return 1;
+}
+
+static int lua_struct_new(lua_State *L)
+{
+    return aggregate_new(L, KIND_STRUCT);
+}
+
+static int lua_union_new(lua_State *L)
+{
+    return aggregate_new(L, KIND_UNION);
+}
+
+/* libffi classifies aggregates of a few words by their elements, and
+ * passes larger ones in memory whatever they hold: an array of more than
+ * ARRAY_ELEMENTS bytes lists a single element rather than count */
+#define ARRAY_ELEMENTS 64
+
+/* push an array type of count elements of the type at idx */
+static struct_t *array_new(lua_State *L, int idx, size_t count)
+{
+    ffi_type *type = lua_touserdata(L, idx);
+    size_t i, nelements;
+    struct_t *s;
+
+    if (!field_ok(type))
+        luaL_error(L, "invalid array element type");
+    if (type->size && count > SIZE_MAX / type->size)
+        luaL_error(L, "array too large");
+    nelements = type->size * count <= ARRAY_ELEMENTS ? count : 1;
+
+    s = struct_alloc(L, KIND_ARRAY, 1, nelements);
+    s->count = count;
+    struct_setfield(s, 0, type);
+    for (i = 0; i < nelements; i++)
+        s->type.elements[i] = type;
+    s->type.elements[nelements] = NULL;
+    s->fields[0].offset = 0;
+    s->type.alignment = type->alignment;
+    s->type.size = type->size * s->count;
+
+    /* keep the element type alive */
+    lua_getfenv(L, -1);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+
+    return s;
+}
+
+/* ffi.array_new(type, count) */
+static int lua_array_new(lua_State *L)
+{
+    size_t count;
+
+    luaL_checkudata(L, 1, "ffi_type");
+    count = checksize(L, 2);
+    array_new(L, 1, count);
+
+    return 1;
+}
+
+static int lua_sizeof(lua_State *L)
+{
+    lua_pushnumber(L, ((ffi_type *) luaL_checkudata(L, 1, "ffi_type"))->size);
+    return 1;
+}
+
+static int lua_alignof(lua_State *L)
+{
+    lua_pushnumber(L, ((ffi_type *) luaL_checkudata(L, 1, "ffi_type"))->alignment);
+    return 1;
+}
+
+/* ffi.offsetof(struct, name or number), or ffi.offsetof(array, number) */
+static int lua_offsetof(lua_State *L)
+{
+    struct_t *s = check_struct(L, 1);
+    lua_Number n;
+    int i;
+
+    if (s->kind == KIND_ARRAY) {
+        n = luaL_checknumber(L, 2);
+        if (n < 1 || n > s->count)
+            return 0;
+        lua_pushnumber(L, (n - 1) * s->fields[0].type->size);
+        return 1;
+    }
+
+    if (!(i = struct_field(L, 1, 2)))
+        return 0;
+
+    lua_pushnumber(L, s->fields[i - 1].offset);
+    return 1;
+}
+
+
+/* struct views
+ *
+ * ffi.view(struct, ptr[, offset]) reads and writes the fields of the
+ * struct, union or array found at ptr in place, array elements are
+ * numbered from 1. Each struct type has its own view
+ * metatable, whose __index and __newindex have the field table of the
+ * type as upvalue: a field access is a table lookup and a conversion by
+ * the precomputed opcode at the precomputed offset. A view keeps the
+ * userdata it points into alive. */
+
+typedef struct {
+    struct_t *s;
+    uint8_t *ptr;
+} view_t;
+
+static int lua_view_index(lua_State *L);
+static int lua_view_newindex(lua_State *L);
+
+static int lua_view_len(lua_State *L)
+{
+    lua_pushnumber(L, ((view_t *) lua_touserdata(L, 1))->s->count);
+    return 1;
+}
+
+/* push the view metatable of the struct type at sidx */
+static void push_view_meta(lua_State *L, int sidx)
+{
+    lua_getfenv(L, sidx);
+    lua_rawgeti(L, -1, 0);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, 1, 4);
+        lua_pushvalue(L, sidx);
+        lua_rawseti(L, -2, 1);
+        lua_pushstring(L, "type");
+        lua_pushstring(L, "ffi_view");
+        lua_rawset(L, -3);
+        lua_pushstring(L, "__index");
+        lua_pushvalue(L, -3);
+        lua_pushcclosure(L, lua_view_index, 1);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "__newindex");
+        lua_pushvalue(L, -3);
+        lua_pushcclosure(L, lua_view_newindex, 1);
+        lua_rawset(L, -3);
+        lua_pushstring(L, "__len");
+        lua_pushcfunction(L, lua_view_len);
+        lua_rawset(L, -3);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, 0);
+    }
+    lua_remove(L, -2);
+}
+
+/* push a view of the struct type at sidx on ptr, kept alive by owner */
+static void push_view(lua_State *L, int sidx, void *ptr, int owner)
+{
+    view_t *v = lua_newuserdata(L, sizeof(view_t));
+
+    v->s = lua_touserdata(L, sidx);
+    v->ptr = ptr;
+
+    if (lua_type(L, owner) == LUA_TUSERDATA) {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, owner);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, -2);
+    }
+
+    push_view_meta(L, sidx);
+    lua_setmetatable(L, -2);
+}
+
+/* field number of the key at 2, upvalue 1 is the field table, and its
+ * offset in *offset, or 0 if there is no such field. The elements of an
+ * array are all its first field. */
+static int view_field(lua_State *L, view_t *v, size_t *offset)
+{
+    struct_t *s = v->s;
+    lua_Number n;
+    int i;
+
+    if (s->kind == KIND_ARRAY) {
+        n = lua_tonumber(L, 2);
+        if (n < 1 || n > s->count)
+            return 0;
+        *offset = ((size_t) n - 1) * s->fields[0].type->size;
+        return 1;
+    }
+
+    if (lua_type(L, 2) == LUA_TNUMBER)
+        i = lua_tointeger(L, 2);
+    else {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        i = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+    }
+
+    if (i < 1 || i > s->nfields)
+        return 0;
+
+    *offset = s->fields[i - 1].offset;
+    return i;
+}
+
+static int lua_view_index(lua_State *L)
+{
+    view_t *v = lua_touserdata(L, 1);
+    size_t offset;
+    int i = view_field(L, v, &offset);
+    field_t *f;
+
+    if (!i)
+        return 0;
+
+    f = &v->s->fields[i - 1];
+    if (f->op == OP_STRUCT) {
+        lua_rawgeti(L, lua_upvalueindex(1), i);
+        push_view(L, lua_gettop(L), v->ptr + offset, 1);
+    } else
+        push_c(L, f->op, v->ptr + offset);
+
+    return 1;
+}
+
+static int lua_view_newindex(lua_State *L)
+{
+    view_t *v = lua_touserdata(L, 1);
+    size_t offset;
+    int i = view_field(L, v, &offset);
+    field_t *f;
+
+    if (!i)
+        return luaL_error(L, "no field %s in %s", lua_tostring(L, 2),
+                          v->s->kind == KIND_ARRAY ? "array" : "struct");
+
+    f = &v->s->fields[i - 1];
+    if (f->op == OP_STRUCT) {
+        view_t *src = lua_touserdata(L, 3);
+
+        /* from a view of the same type or from a struct userdata */
+        lua_rawgeti(L, lua_upvalueindex(1), i);
+        push_view_meta(L, lua_gettop(L));
+        if (lua_getmetatable(L, 3) && lua_rawequal(L, -1, -2))
+            memcpy(v->ptr + offset, src->ptr, f->type->size);
+        else {
+            void *ptr = toptr(L, 3);
+
+            luaL_argcheck(L, ptr != NULL, 3, "struct expected");
+            memcpy(v->ptr + offset, ptr, f->type->size);
+        }
+    } else
+        to_c(L, 3, f->op, v->ptr + offset);
+
+    return 0;
+}
+
+static int lua_view(lua_State *L)
+{
+    uint8_t *ptr = toptr(L, 2);
+
+    check_struct(L, 1);
+    luaL_argcheck(L, ptr != NULL, 2, "pointer expected");
+
+    push_view(L, 1, ptr + (size_t) luaL_optnumber(L, 3, 0), 2);
+    return 1;
+}
+
+/* call f through the cif c with the lua arguments starting at base, a
+ * struct return value is stored at dst, or in a new userdata when dst is
+ * NULL */
+static int call_cif(lua_State *L, cif_t *c, void *f, int base, void *dst)
+{
+    int i, j, nargs = c->cif.nargs;
+    uint8_t *frame;
+    void **pargs;
+    void *rval;
+
+    /* missing arguments are nil */
+    if (lua_gettop(L) < base + c->nlargs - 1) {
+        luaL_checkstack(L, c->nlargs, "too many arguments");
+        lua_settop(L, base + c->nlargs - 1);
+    }
+
+    if (c->thunk && jit_enabled) {
+        frame = alloca(c->frame);
+
+        for (i = 0; i < nargs; i++)
+            to_c(L, base + c->args[i].larg, c->args[i].op, frame + c->args[i].offset);
+        if (c->nouts)
+            outs_to_c(L, c, frame, base);
+
+        c->thunk(f, frame, frame + c->roffset);
+
+        if (c->rop == OP_VOID)
+            return c->nouts ? push_outs(L, c, frame) : 0;
+
+        push_c(L, c->rop, frame + c->roffset);
+        return c->nouts ? 1 + push_outs(L, c, frame) : 1;
+    }
+
+    if (c->stub) {
+        stubval_t args[4], res;
+
+        for (i = 0; i < nargs; i++)
+            to_c(L, base + c->args[i].larg, c->args[i].op, &args[i]);
+
+        c->stub(f, args, &res);
+
+        if (c->rop == OP_VOID)
+            return 0;
+
+        push_c(L, c->rop, &res);
+        return 1;
+    }
+
+    frame = alloca(c->frame + sizeof(void *) * nargs);
+    pargs = (void **) (frame + c->frame);
+
+    for (i = 0; i < nargs; i++) {
+        j = base + c->args[i].larg;
+        if (c->args[i].op == OP_STRUCT)
+            pargs[i] = toptr(L, j);
+        else {
+            pargs[i] = frame + c->args[i].offset;
+            to_c(L, j, c->args[i].op, pargs[i]);
+        }
+    }
+    if (c->nouts)
+        outs_to_c(L, c, frame, base);
+
+    if (c->rop == OP_STRUCT) {
+        if (dst) {
+            ffi_call(&c->cif, FFI_FN(f), dst, pargs);
+            return c->nouts ? push_outs(L, c, frame) : 0;
+        }
+        rval = lua_newuserdata(L, c->cif.rtype->size);
+        ffi_call(&c->cif, FFI_FN(f), rval, pargs);
+        /* the result is already in the stack */
+        return c->nouts ? 1 + push_outs(L, c, frame) : 1;
+    }
+
+    rval = frame + c->roffset;
+    ffi_call(&c->cif, FFI_FN(f), rval, pargs);
+
+    if (c->rop == OP_VOID)
+        return c->nouts ? push_outs(L, c, frame) : 0;
+
+    push_c(L, c->rop, rval);
+    if (c->nouts)
+        return 1 + push_outs(L, c, frame);
+    return 1;
+}
+
+static int lua_ffi_call(lua_State *L)
+{
+    /* commented out for efficiency purpose, anyway, we're supposed to know what we do here */
+    /*luaL_checkudata(L, 1, "ffi_cif");*/
+
+    return call_cif(L, (cif_t *) lua_touserdata(L, 1), lua_touserdata(L, 2), 3, NULL);
+}
+
+/* ffi.call_into(dst, cif, f, ...) stores a struct return value at dst, a
+ * userdata or a pointer, and returns dst */
+static int lua_call_into(lua_State *L)
+{
+    void *dst = toptr(L, 1);
+    cif_t *c = lua_touserdata(L, 2);
+    int n;
+
+    luaL_argcheck(L, dst != NULL, 1, "destination expected");
+
+    n = call_cif(L, c, lua_touserdata(L, 3), 4, dst);
+    if (c->rop != OP_STRUCT && c->rop != OP_VOID)
+        return n;
+
+    /* dst stands for the return value, before the out values */
+    lua_pushvalue(L, 1);
+    lua_insert(L, -n - 1);
+    return n + 1;
+}
+
+/* variadic calls: ffi.call_var(cif, f, ...) calls f with the fixed
+ * arguments of cif followed by the remaining arguments, typed after their
+ * lua values: int for integral numbers that fit, double for the other
+ * numbers, int for booleans, int64_t for ffi.int64 boxes and pointers
+ * otherwise. The cif of each shape is kept in a small LRU cache per
+ * state. */
+
+#define VARCACHE_SIZE 64
+#define VAR_MAXARGS 32          /* longer shapes are not cached */
+
+enum { VAR_INT, VAR_DOUBLE, VAR_POINTER, VAR_INT64 };
+
+typedef struct {
+    cif_t *fixed;
+    int n;
+    uint8_t shape[VAR_MAXARGS];
+    unsigned long stamp;        /* of the last use */
+    int ref;                    /* registry reference to the cif */
+} varentry_t;
+
+typedef struct {
+    unsigned long clock;
+    varentry_t entries[VARCACHE_SIZE];
+} varcache_t;
+
+static char varcache_key;
+
+static varcache_t *get_varcache(lua_State *L)
+{
+    varcache_t *cache;
+    int i;
+
+    lua_pushlightuserdata(L, &varcache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    cache = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (cache)
+        return cache;
+
+    cache = lua_newuserdata(L, sizeof(varcache_t));
+    memset(cache, 0, sizeof(varcache_t));
+    for (i = 0; i < VARCACHE_SIZE; i++)
+        cache->entries[i].ref = LUA_NOREF;
+    lua_pushlightuserdata(L, &varcache_key);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    return cache;
+}
+
+/* push a new variadic cif extending the cif at idx with the given shape */
+static cif_t *var_cif(lua_State *L, int idx, const uint8_t *shape, int n)
+{
+    static ffi_type *const vartypes[] = {
+        &ffi_type_sint, &ffi_type_double, &ffi_type_pointer, &ffi_type_sint64
+    };
+    cif_t *fixed = lua_touserdata(L, idx), *c;
+    int i, nfixed = fixed->cif.nargs, nargs = nfixed + n;
+    ffi_type **types;
+
+    c = lua_newuserdata(L, sizeof(cif_t) + (sizeof(argplan_t) + sizeof(ffi_type *)) * nargs);
+    luaL_getmetatable(L, "ffi_cif");
+    lua_setmetatable(L, -2);
+
+    c->code = NULL;
+    c->variadic = 1;
+    c->args = (argplan_t *) (c + 1);
+    types = (ffi_type **) (c->args + nargs);
+
+    /* the fixed cif keeps the types alive */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+
+    memcpy(types, fixed->cif.arg_types, sizeof(ffi_type *) * nfixed);
+    for (i = 0; i < n; i++)
+        types[nfixed + i] = vartypes[shape[i]];
+
+    if (ffi_prep_cif_var(&c->cif, fixed->cif.abi, nfixed, nargs, fixed->cif.rtype,
+                         types) != FFI_OK) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    plan_cif(c);
+
+    return c;
+}
+
+static int lua_call_var(lua_State *L)
+{
+    cif_t *fixed = luaL_checkudata(L, 1, "ffi_cif"), *c;
+    void *f = lua_touserdata(L, 2);
+    int i, base = 3 + fixed->nlargs, n = lua_gettop(L) - base + 1;
+    uint8_t *shape;
+    varcache_t *cache;
+    varentry_t *e, *lru;
+
+    if (n < 0)
+        n = 0;
+    shape = alloca(n + 1);
+
+    for (i = 0; i < n; i++) {
+        int idx = base + i;
+        lua_Number d;
+
+        switch (lua_type(L, idx)) {
+            case LUA_TNUMBER:
+                d = lua_tonumber(L, idx);
+                shape[i] = d >= INT_MIN && d <= INT_MAX && d == (lua_Number) (int) d
+                    ? VAR_INT : VAR_DOUBLE;
+                break;
+            case LUA_TBOOLEAN:
+                lua_pushinteger(L, lua_toboolean(L, idx));
+                lua_replace(L, idx);
+                shape[i] = VAR_INT;
+                break;
+            default:
+                shape[i] = test_int64(L, idx) ? VAR_INT64 : VAR_POINTER;
+        }
+    }
+
+    if (n > VAR_MAXARGS) {
+        if (!(c = var_cif(L, 1, shape, n)))
+            return 0;
+        lua_insert(L, 1);
+        return call_cif(L, c, f, 4, NULL);
+    }
+
+    /* the cached cifs keep their fixed cif alive, so a pointer match is
+     * always the same cif */
+    cache = get_varcache(L);
+    lru = &cache->entries[0];
+    for (e = cache->entries; e < cache->entries + VARCACHE_SIZE; e++) {
+        if (e->fixed == fixed && e->n == n && !memcmp(e->shape, shape, n))
+            break;
+        if (e->stamp < lru->stamp)
+            lru = e;
+    }
+
+    if (e < cache->entries + VARCACHE_SIZE) {
+        stats.var_hits++;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, e->ref);
+    } else {
+        stats.var_misses++;
+        if (!var_cif(L, 1, shape, n))
+            return 0;
+        /* replace the least recently used entry */
+        e = lru;
+        luaL_unref(L, LUA_REGISTRYINDEX, e->ref);
+        lua_pushvalue(L, -1);
+        e->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        e->fixed = fixed;
+        e->n = n;
+        memcpy(e->shape, shape, n);
+    }
+    e->stamp = ++cache->clock;
+    c = lua_touserdata(L, -1);
+
+    /* the cif on top is not an argument */
+    lua_insert(L, 1);
+    return call_cif(L, c, f, 4, NULL);
+}
+
+/* bound callables: the cif and the function pointer are upvalues of a C
+ * closure, so a call goes straight from the lua stack to ffi_call */
+
+static int lua_bound_call(lua_State *L)
+{
+    return call_cif(L, (cif_t *) lua_touserdata(L, lua_upvalueindex(1)),
+                    lua_touserdata(L, lua_upvalueindex(2)), 1, NULL);
+}
+
+/* struct results go to the destination in upvalue 3, whose memory is
+ * upvalue 4 */
+static int lua_bound_call_into(lua_State *L)
+{
+    int n = call_cif(L, (cif_t *) lua_touserdata(L, lua_upvalueindex(1)),
+                     lua_touserdata(L, lua_upvalueindex(2)), 1,
+                     lua_touserdata(L, lua_upvalueindex(4)));
+
+    /* the destination comes before the out values */
+    lua_pushvalue(L, lua_upvalueindex(3));
+    lua_insert(L, -n - 1);
+    return n + 1;
+}
+
+/* struct results go in turn to the userdata of the pool in upvalue 3,
+ * upvalue 4 is the next one to use */
+static int lua_bound_call_pool(lua_State *L)
+{
+    int n, next = lua_tointeger(L, lua_upvalueindex(4));
+    void *dst;
+
+    /* not left on the stack, where a missing argument would see it */
+    lua_rawgeti(L, lua_upvalueindex(3), next);
+    dst = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    n = call_cif(L, (cif_t *) lua_touserdata(L, lua_upvalueindex(1)),
+                 lua_touserdata(L, lua_upvalueindex(2)), 1, dst);
+
+    lua_pushinteger(L, next < (int) lua_objlen(L, lua_upvalueindex(3)) ? next + 1 : 1);
+    lua_replace(L, lua_upvalueindex(4));
+
+    /* the result comes before the out values */
+    lua_rawgeti(L, lua_upvalueindex(3), next);
+    lua_insert(L, -n - 1);
+    return n + 1;
+}
+
+/* variadic functions go through ffi.call_var, upvalue 1 is the cif of
+ * the fixed arguments */
+static int lua_bound_call_var(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_insert(L, 2);
+
+    return lua_call_var(L);
+}
+
+/* ffi.bind(cif, f[, dst]), for a cif returning a struct dst is either a
+ * userdata or pointer where every call stores its result, or the number
+ * n of result userdata to recycle in turn, a result then stays valid
+ * until n more calls */
+static int lua_bind(lua_State *L)
+{
+    cif_t *c = luaL_checkudata(L, 1, "ffi_cif");
+    int i, n;
+
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+
+    if (lua_isnoneornil(L, 3)) {
+        lua_settop(L, 2);
+        lua_pushcclosure(L, lua_bound_call, 2);
+        return 1;
+    }
+
+    luaL_argcheck(L, c->rop == OP_STRUCT, 3, "cif doesn't return a struct");
+
+    if (lua_isuserdata(L, 3)) {
+        lua_settop(L, 3);
+        lua_pushlightuserdata(L, toptr(L, 3));
+        lua_pushcclosure(L, lua_bound_call_into, 4);
+        return 1;
+    }
+
+    n = luaL_checkint(L, 3);
+    luaL_argcheck(L, n > 0, 3, "invalid pool size");
+
+    lua_settop(L, 2);
+    lua_createtable(L, n, 0);
+    for (i = 1; i <= n; i++) {
+        lua_newuserdata(L, c->cif.rtype->size);
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushinteger(L, 1);
+    lua_pushcclosure(L, lua_bound_call_pool, 4);
+
+    return 1;
+}
+
+/* batched calls: ffi.call_many(cif, f, n, argbuf1, ..., outbuf) calls f n
+ * times, taking the i-th arguments from the argument buffers and storing
+ * the i-th result in outbuf. A buffer is a pointer to n packed values,
+ * or a { pointer, stride } table. outbuf may be nil to drop the results. */
+
+typedef struct {
+    uint8_t *ptr;
+    size_t stride;
+    size_t size;                /* known size at ptr, (size_t) -1 if not */
+} column_t;
+
+static void get_column(lua_State *L, int idx, size_t size, column_t *col)
+{
+    if (lua_istable(L, idx)) {
+        int64_t stride;
+
+        lua_rawgeti(L, idx, 1);
+        lua_rawgeti(L, idx, 2);
+        col->ptr = tomem(L, -2, &col->size);
+        stride = lua_isnil(L, -1) ? (int64_t) size : to_int64(L, -1, NULL);
+        luaL_argcheck(L, stride >= 0, idx, "invalid stride");
+        col->stride = stride;
+        lua_pop(L, 2);
+    } else {
+        col->ptr = tomem(L, idx, &col->size);
+        col->stride = size;
+    }
+}
+
+/* whether n values of size bytes, stride apart, lie within the column */
+static int column_fits(const column_t *col, size_t n, size_t size)
+{
+    if (n == 0 || col->size == (size_t) -1)
+        return 1;
+    if (size > col->size)
+        return 0;
+    return col->stride == 0 || n - 1 <= (col->size - size) / col->stride;
+}
+
+static int lua_call_many(lua_State *L)
+{
+    cif_t *c = luaL_checkudata(L, 1, "ffi_cif");
+    void *f = lua_touserdata(L, 2);
+    lua_Integer count = luaL_checkinteger(L, 3);
+    size_t k, n = count;
+    int i, nargs = c->cif.nargs;
+    size_t rsize = c->rop == OP_VOID ? 0 : c->cif.rtype->size;
+    column_t *cols, out;
+    uint8_t *frame, *rval;
+    void **pargs;
+
+    luaL_argcheck(L, count >= 0, 3, "negative count");
+
+    luaL_argcheck(L, c->nouts == 0, 1, "out arguments can't be batched");
+    lua_settop(L, 3 + nargs + 1);
+
+    frame = alloca(c->frame + (sizeof(void *) + sizeof(column_t)) * nargs);
+    pargs = (void **) (frame + c->frame);
+    cols = (column_t *) (pargs + nargs);
+    rval = frame + c->roffset;
+
+    for (i = 0; i < nargs; i++) {
+        get_column(L, 4 + i, c->cif.arg_types[i]->size, &cols[i]);
+        if (!cols[i].ptr)
+            return luaL_argerror(L, 4 + i, "argument buffer expected");
+        luaL_argcheck(L, column_fits(&cols[i], n, c->cif.arg_types[i]->size), 4 + i, "out of bounds");
+    }
+    get_column(L, 4 + nargs, rsize, &out);
+    if (!out.ptr)
+        rsize = 0;
+    luaL_argcheck(L, column_fits(&out, n, rsize), 4 + nargs, "out of bounds");
+
+    for (k = 0; k < n; k++) {
+        if (c->thunk && jit_enabled) {
+            for (i = 0; i < nargs; i++)
+                memcpy(frame + c->args[i].offset, cols[i].ptr + k * cols[i].stride,
+                       c->cif.arg_types[i]->size);
+            c->thunk(f, frame, rval);
+        } else if (c->stub) {
+            stubval_t args[4];
+
+            for (i = 0; i < nargs; i++)
+                memcpy(&args[i], cols[i].ptr + k * cols[i].stride, c->cif.arg_types[i]->size);
+            c->stub(f, args, (stubval_t *) rval);
+        } else {
+            for (i = 0; i < nargs; i++)
+                pargs[i] = cols[i].ptr + k * cols[i].stride;
+            ffi_call(&c->cif, FFI_FN(f), rval, pargs);
+        }
+
+        if (rsize)
+            memcpy(out.ptr + k * out.stride, rval, rsize);
+    }
+
+    return 0;
+}
+
+/* ffi.jit(flag) switches the jit on or off globally and returns the
+ * previous state, ffi.jit(cif, flag) selects the thunk for one cif, that
+ * is for its signature as cifs are interned, and returns whether it is in
+ * use */
+static int lua_jit(lua_State *L)
+{
+    cif_t *c;
+
+    if (lua_isboolean(L, 1) || lua_isnoneornil(L, 1)) {
+        lua_pushboolean(L, jit_enabled);
+        if (lua_isboolean(L, 1))
+            jit_enabled = lua_toboolean(L, 1);
+        return 1;
+    }
+
+    c = luaL_checkudata(L, 1, "ffi_cif");
+
+    if (!lua_toboolean(L, 2))
+        c->thunk = NULL;
+    else if (jit_enabled && jit_compile(c))
+        c->thunk = c->compiled;
+
+    lua_pushboolean(L, c->thunk != NULL);
+    return 1;
+}
+
+static int lua_cif_gc(lua_State *L)
+{
+    jit_free((cif_t *) lua_touserdata(L, 1));
+    return 0;
+}
+
+static funcreg_t cif_metafuncs[] = {
+    { "__gc", lua_cif_gc },
+    NULL
+};
+static stringreg_t cif_metastrings[] = {
+    { "type", "ffi_cif" },
+    NULL
+};
+
+static stringreg_t type_metastrings[] = {
+    { "type", "ffi_type" },
+    NULL
+};
+
+
+/* closures */
+
+#include <pthread.h>
+#include <sched.h>
+
+enum { CLOSURE_DIRECT, CLOSURE_ASYNC, CLOSURE_SYNC };
+
+struct cbqueue;
+
+typedef struct {
+    lua_State *L;
+    ffi_closure *writable;
+    void *f;
+    int func;                   /* registry references to the lua function */
+    int cif;                    /* and to the cif, which must outlive the closure */
+    int mode;                   /* what a call from another thread does */
+    pthread_t owner;            /* the thread running L */
+    struct cbqueue *queue;
+} closure_t;
+
+/* calls coming from threads other than the owner are queued into a
+ * bounded lock-free ring (one slot per call, sequence numbered so that
+ * any number of producers can claim slots), and run when the owner
+ * calls ffi.poll_callbacks() */
+
+#define CBQUEUE_SIZE 1024       /* must be a power of 2 */
+#define CBSLOT_INLINE 64        /* argument frames up to this size stay in the slot */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+} cbwait_t;
+
+typedef struct {
+    size_t seq;
+    closure_t *c;               /* NULL once the closure is collected */
+    void *resp;                 /* result of a sync call */
+    cbwait_t *wait;             /* NULL for an async call */
+    uint8_t *args;              /* marshaled arguments, laid out as the cif plan */
+    union {
+        uint8_t b[CBSLOT_INLINE];
+        long double align;
+    } buf;
+} cbslot_t;
+
+typedef struct cbqueue {
+    size_t head;                /* next slot to claim, shared by producers */
+    size_t tail;                /* next slot to run, owner only */
+    cbslot_t *slots;
+} cbqueue_t;
+
+static char cbqueue_key;
+
+static cbqueue_t *get_cbqueue(lua_State *L, int create)
+{
+    cbqueue_t *q;
+    size_t i;
+
+    lua_pushlightuserdata(L, &cbqueue_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    q = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (q || !create)
+        return q;
+
+    q = lua_newuserdata(L, sizeof(cbqueue_t));
+    q->head = q->tail = 0;
+    q->slots = malloc(CBQUEUE_SIZE * sizeof(cbslot_t));
+    luaL_getmetatable(L, "ffi_cbqueue");
+    lua_setmetatable(L, -2);
+    if (!q->slots) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    for (i = 0; i < CBQUEUE_SIZE; i++)
+        q->slots[i].seq = i;
+
+    lua_pushlightuserdata(L, &cbqueue_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+
+    return q;
+}
+
+static int lua_cbqueue_gc(lua_State *L)
+{
+    cbqueue_t *q = lua_touserdata(L, 1);
+    size_t i;
+
+    if (!q->slots)
+        return 0;
+
+    /* drop whatever was never polled */
+    for (i = q->tail; i != q->head; i++) {
+        cbslot_t *slot = &q->slots[i & (CBQUEUE_SIZE - 1)];
+        if (slot->args != slot->buf.b)
+            free(slot->args);
+    }
+    free(q->slots);
+    q->slots = NULL;
+
+    return 0;
+}
+
+static void closure_enqueue(closure_t *c, cif_t *p, void *resp, void **args)
+{
+    cbqueue_t *q = c->queue;
+    cbslot_t *slot;
+    cbwait_t wait;
+    size_t pos, seq;
+    unsigned i;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &q->slots[pos & (CBQUEUE_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else {
+            if ((intptr_t) (seq - pos) < 0)
+                sched_yield();  /* full, wait for the owner to drain it */
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->c = c;
+    slot->args = p->frame <= CBSLOT_INLINE ? slot->buf.b : malloc(p->frame);
+    if (slot->args)
+        for (i = 0; i < p->cif.nargs; i++)
+            memcpy(slot->args + p->args[i].offset, args[i],
+                   p->cif.arg_types[i]->size);
+
+    if (c->mode == CLOSURE_SYNC) {
+        pthread_mutex_init(&wait.lock, NULL);
+        pthread_cond_init(&wait.cond, NULL);
+        wait.done = 0;
+        slot->wait = &wait;
+        slot->resp = resp;
+    } else {
+        /* async callers get a zero result right away */
+        memset(resp, 0, p->cif.rtype->size < sizeof(ffi_arg)
+               ? sizeof(ffi_arg) : p->cif.rtype->size);
+        slot->wait = NULL;
+        slot->resp = NULL;
+    }
+
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (c->mode == CLOSURE_SYNC) {
+        pthread_mutex_lock(&wait.lock);
+        while (!wait.done)
+            pthread_cond_wait(&wait.cond, &wait.lock);
+        pthread_mutex_unlock(&wait.lock);
+        pthread_cond_destroy(&wait.cond);
+        pthread_mutex_destroy(&wait.lock);
+    }
+}
+
+/* run the lua function of c; when protected, an error is left on the
+ * stack and its status returned, otherwise it propagates */
+static int closure_call(lua_State *L, closure_t *c, cif_t *p, void *resp,
+                        void **args, int protected)
+{
+    int i, j, nargs = p->cif.nargs;
+    int nres = p->rop == OP_VOID ? 0 : 1;
+    int sp = lua_gettop(L);
+
+    luaL_checkstack(L, nargs + nres + p->nouts + 1, "too many callback arguments");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, c->func);
+
+    /* a Tlstring comes back as one lua string, an inout argument as its
+     * value and an out argument not at all */
+    for (i = 0; i < nargs; i++) {
+        if (i + 1 < nargs && p->args[i + 1].op == OP_LSTRLEN) {
+            const char *s = *(const char **) args[i];
+
+            lua_pushlstring(L, s ? s : "", *(size_t *) args[i + 1]);
+            i++;
+        } else if (p->args[i].op != OP_OUT)
+            push_c(L, p->args[i].op, args[i]);
+        else if (!p->args[i].inout)
+            continue;
+        else if (*(void **) args[i])
+            push_c(L, p->args[i].top, *(void **) args[i]);
+        else
+            lua_pushnil(L);
+    }
+
+    if (!protected)
+        lua_call(L, p->nlargs, nres + p->nouts);
+    else if ((i = lua_pcall(L, p->nlargs, nres + p->nouts, 0)) != 0)
+        return i;
+
+    if (p->rop == OP_STRUCT)
+        memcpy(resp, toptr(L, sp + 1), p->cif.rtype->size);
+    else if (p->rop != OP_VOID)
+        to_c(L, sp + 1, p->rop, resp);
+
+    /* the extra results are the out values, nil leaves one unchanged */
+    for (i = 0, j = sp + 1 + nres; p->nouts && i < nargs; i++) {
+        void *dst;
+
+        if (p->args[i].op != OP_OUT)
+            continue;
+        if ((dst = *(void **) args[i]) && !lua_isnil(L, j)) {
+            if (p->args[i].top != OP_STRUCT)
+                to_c(L, j, p->args[i].top, dst);
+            else if (lua_touserdata(L, j))
+                memcpy(dst, toptr(L, j), p->cif.arg_types[i]->elements[0]->size);
+        }
+        j++;
+    }
+
+    /* restore stack balance */
+    lua_settop(L, sp);
+    return 0;
+}
+
+static void lua_ffi_closure(ffi_cif *cif, void *resp, void **args,
+                            void *userdata)
+{
+    closure_t *c = (closure_t *) userdata;
+
+    if (c->mode != CLOSURE_DIRECT && !pthread_equal(pthread_self(), c->owner))
+        closure_enqueue(c, (cif_t *) cif, resp, args);
+    else
+        closure_call(c->L, c, (cif_t *) cif, resp, args, 0);
+}
+
+/* run one queued call, wake its caller and release the slot */
+static int cbslot_run(lua_State *L, cbslot_t *slot, size_t pos)
+{
+    closure_t *c = slot->c;
+    cif_t *p = c ? (cif_t *) c->writable->cif : NULL;
+    void *resp = slot->resp;
+    int i, status = 0;
+
+    if (!c)
+        ;                       /* cancelled by closure_cancel */
+    else if (slot->args) {
+        void **args = alloca(p->cif.nargs * sizeof(void *));
+
+        /* async results land in the frame's own result slot */
+        if (!resp)
+            resp = slot->args + p->roffset;
+        for (i = 0; i < (int) p->cif.nargs; i++)
+            args[i] = slot->args + p->args[i].offset;
+        status = closure_call(L, c, p, resp, args, 1);
+        if (slot->args != slot->buf.b)
+            free(slot->args);
+    }
+    if (c && slot->resp && (status || !slot->args))
+        memset(slot->resp, 0, p->cif.rtype->size);
+
+    if (slot->wait) {
+        pthread_mutex_lock(&slot->wait->lock);
+        slot->wait->done = 1;
+        pthread_cond_signal(&slot->wait->cond);
+        pthread_mutex_unlock(&slot->wait->lock);
+    }
+    __atomic_store_n(&slot->seq, pos + CBQUEUE_SIZE, __ATOMIC_RELEASE);
+
+    return status;
+}
+
+static int lua_poll_callbacks(lua_State *L)
+{
+    cbqueue_t *q = get_cbqueue(L, 0);
+    int max = luaL_optint(L, 1, CBQUEUE_SIZE);
+    int n = 0;
+
+    while (q && n < max) {
+        size_t pos = q->tail;
+        cbslot_t *slot = &q->slots[pos & (CBQUEUE_SIZE - 1)];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        /* a callback may poll again, it must see the next slot */
+        q->tail++;
+
+        if (cbslot_run(L, slot, pos))
+            return lua_error(L);
+        n++;
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_closure_new(lua_State *L)
+{
+    static const char *const modes[] = { "direct", "async", "sync", NULL };
+    cif_t *p = luaL_checkudata(L, 1, "ffi_cif");
+    closure_t *c;
+    int mode;
+
+    mode = luaL_checkoption(L, 3, "direct", modes);
+    /* an async caller has returned by the time the results are known */
+    luaL_argcheck(L, mode != CLOSURE_ASYNC || p->nouts == 0, 1,
+                  "out arguments in an async closure");
+
+    c = lua_newuserdata(L, sizeof(closure_t));
+    if (!c)
+        return 0;
+
+    c->L = L;
+    c->func = c->cif = LUA_NOREF;
+    c->mode = mode;
+    c->owner = pthread_self();
+    c->queue = NULL;
+    c->writable = ffi_closure_alloc(sizeof(ffi_closure), &c->f);
+
+    luaL_getmetatable(L, "ffi_closure");
+    lua_setmetatable(L, -2);
+
+    if (!c->writable)
+        return 0;
+
+    if (mode != CLOSURE_DIRECT && !(c->queue = get_cbqueue(L, 1)))
+        return 0;
+
+    lua_pushvalue(L, 2);
+    c->func = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    c->cif = luaL_ref(L, LUA_REGISTRYINDEX);
+    
+    if (ffi_prep_closure(c->writable, (ffi_cif *) lua_touserdata(L, 1),
+                         lua_ffi_closure, c) != FFI_OK)
+        return 0;
+
+    return 1;
+}
+
+/* cancel the calls of c still queued, with a zero result, so that the
+ * owner doesn't run them once c is freed */
+static void closure_cancel(closure_t *c)
+{
+    cbqueue_t *q = c->queue;
+    cif_t *p = (cif_t *) c->writable->cif;
+    size_t pos, head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+
+    for (pos = q->tail; pos != head; pos++) {
+        cbslot_t *slot = &q->slots[pos & (CBQUEUE_SIZE - 1)];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1 || slot->c != c)
+            continue;
+        if (slot->args != slot->buf.b)
+            free(slot->args);
+        slot->args = NULL;
+        if (slot->resp)
+            memset(slot->resp, 0, p->cif.rtype->size);
+        slot->c = NULL;
+    }
+}
+
+static int lua_closure_gc(lua_State *L)
+{
+    closure_t *c = lua_touserdata(L, 1);
+
+    if (c->queue && c->queue->slots && c->writable)
+        closure_cancel(c);
+    if (c->writable)
+        ffi_closure_free(c->writable);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, c->func);
+    luaL_unref(L, LUA_REGISTRYINDEX, c->cif);
+    
+    return 0;
+}
+
+static int lua_closure_index(lua_State *L)
+{
+    closure_t *c = lua_touserdata(L, 1);
+    const char *index = lua_tostring(L, 2);
+
+    if (!strcmp(index, "func")) {
+        /* hmmm, under x86 linux, if I try to call c->f, it crashes, so
+         * I simply return c->writable, is it be a problem under other architectures ? */
+        lua_pushlightuserdata(L, c->writable);
+        //lua_pushlightuserdata(L, c->f);
+        return 1;
+    } else if (!strcmp(index, "cif")) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, c->cif);
+        return 1;
+    } else if (!strcmp(index, "writable")) {
+        lua_pushlightuserdata(L, c->writable);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static stringreg_t closure_metastrings[] = {
+    { "type", "ffi_closure" },
+    NULL
+};
+static funcreg_t closure_metafuncs[] = {
+    { "__gc", lua_closure_gc },
+    { "__index", lua_closure_index },
+    NULL
+};
+static funcreg_t cbqueue_metafuncs[] = {
+    { "__gc", lua_cbqueue_gc },
+    NULL
+};
+
+
+/* asynchronous calls */
+/* ffi.call_async(cif, f, ...) marshals the arguments into a job and
+ * returns it as a handle, a pool of worker threads runs ffi_call and the
+ * results are converted back to lua on the owning thread. Each worker has
+ * its own bounded queue, idle workers steal from the others. */
+
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#define POOL_DEPTH 256          /* default queue depth per worker */
+
+struct pool;
+
+typedef struct job {
+    cif_t *c;
+    void *f;
+    struct pool *pool;
+    int done;
+    uint64_t submitted;
+    uint8_t *frame;             /* arguments and result, laid out as the cif plan */
+    void **pargs;
+    int notify;                 /* resume the coroutine co once done */
+    int ref, co;                /* registry references to the job and the coroutine */
+    struct job *next;           /* in the completion lists */
+} job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    job_t **ring;
+    size_t head, count;
+} jobqueue_t;
+
+typedef struct {
+    size_t submitted, completed, rejected, stolen;
+    uint64_t wait_ns, wait_max_ns, run_ns;
+} poolstats_t;
+
+typedef struct pool {
+    int nthreads, started;
+    size_t depth;
+    pthread_t *threads;
+    jobqueue_t *queues;
+    unsigned next;              /* round robin submission */
+    int pending, sleeping, stop;
+    pthread_mutex_t lock;       /* idle workers and waiters sleep on it */
+    pthread_cond_t work, done;
+    int waiters;
+    poolstats_t stats;
+    job_t *completed;           /* stack of finished coroutine calls, shared */
+    job_t *ready;               /* the same in completion order, owner only */
+    int fd[2];                  /* completion fd, read and write ends */
+} pool_t;
+
+static char pool_key;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int jobqueue_push(jobqueue_t *q, size_t depth, job_t *job)
+{
+    int ok;
+
+    pthread_mutex_lock(&q->lock);
+    ok = q->count < depth;
+    if (ok)
+        q->ring[(q->head + q->count++) % depth] = job;
+    pthread_mutex_unlock(&q->lock);
+
+    return ok;
+}
+
+static job_t *jobqueue_pop(jobqueue_t *q, size_t depth)
+{
+    job_t *job = NULL;
+
+    /* unlocked peek, stealing workers skip empty queues cheaply */
+    if (!__atomic_load_n(&q->count, __ATOMIC_RELAXED))
+        return NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count) {
+        job = q->ring[q->head];
+        q->head = (q->head + 1) % depth;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return job;
+}
+
+/* make the completion fd readable */
+static void pool_signal(pool_t *pool)
+{
+    uint64_t one = 1;
+    ssize_t n;
+
+    do
+        n = write(pool->fd[1], &one, pool->fd[0] == pool->fd[1] ? sizeof(one) : 1);
+    while (n < 0 && errno == EINTR);
+}
+
+static void pool_clear(pool_t *pool)
+{
+    uint64_t buf[8];
+
+    while (read(pool->fd[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void job_run(job_t *job)
+{
+    cif_t *c = job->c;
+    pool_t *pool = job->pool;
+    uint64_t start = now_ns(), wait = start - job->submitted;
+    uint64_t max = __atomic_load_n(&pool->stats.wait_max_ns, __ATOMIC_RELAXED);
+
+    if (c->thunk && jit_enabled)
+        c->thunk(job->f, job->frame, job->frame + c->roffset);
+    else
+        ffi_call(&c->cif, FFI_FN(job->f), job->frame + c->roffset, job->pargs);
+
+    __atomic_add_fetch(&pool->stats.wait_ns, wait, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->stats.run_ns, now_ns() - start, __ATOMIC_RELAXED);
+    while (wait > max && !__atomic_compare_exchange_n(&pool->stats.wait_max_ns, &max, wait, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&pool->stats.completed, 1, __ATOMIC_RELAXED);
+
+    if (job->notify) {
+        /* the owner may run and free the job as soon as it is pushed */
+        job_t *head = __atomic_load_n(&pool->completed, __ATOMIC_RELAXED);
+
+        job->done = 1;
+        do
+            job->next = head;
+        while (!__atomic_compare_exchange_n(&pool->completed, &head, job, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (!head)
+            pool_signal(pool);
+        return;
+    }
+
+    __atomic_store_n(&job->done, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+typedef struct {
+    pool_t *pool;
+    int id;
+} worker_t;
+
+static void *pool_worker(void *arg)
+{
+    pool_t *pool = ((worker_t *) arg)->pool;
+    int i, id = ((worker_t *) arg)->id;
+
+    free(arg);
+
+    for (;;) {
+        job_t *job = jobqueue_pop(&pool->queues[id], pool->depth);
+
+        for (i = 1; !job && i < pool->nthreads; i++) {
+            job = jobqueue_pop(&pool->queues[(id + i) % pool->nthreads], pool->depth);
+            if (job)
+                __atomic_add_fetch(&pool->stats.stolen, 1, __ATOMIC_RELAXED);
+        }
+
+        if (job) {
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            job_run(job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) && !pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        i = pool->stop && !__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->lock);
+
+        /* queued jobs are always run, handles wait for them */
+        if (i)
+            break;
+    }
+
+    return NULL;
+}
+
+static int pool_submit(pool_t *pool, job_t *job)
+{
+    int i;
+
+    job->pool = pool;
+    job->done = 0;
+    job->submitted = now_ns();
+
+    /* the next worker in turn, or any other one with room left */
+    for (i = 0; i < pool->nthreads; i++)
+        if (jobqueue_push(&pool->queues[(pool->next + i) % pool->nthreads], pool->depth, job))
+            break;
+    pool->next++;
+
+    if (i == pool->nthreads) {
+        job->pool = NULL;
+        job->done = 1;
+        pool->stats.rejected++;
+        return 0;
+    }
+    pool->stats.submitted++;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return 1;
+}
+
+static void job_wait(job_t *job)
+{
+    pool_t *pool = job->pool;
+
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return;
+
+    __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&pool->lock);
+    while (!__atomic_load_n(&job->done, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* stop the workers once every queued job has run */
+static void pool_shutdown(pool_t *pool)
+{
+    int i;
+
+    if (!pool->threads)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->started; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].ring);
+    }
+    free(pool->queues);
+    free(pool->threads);
+    pool->queues = NULL;
+    pool->threads = NULL;
+
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static int lua_pool_gc(lua_State *L)
+{
+    pool_t *pool = lua_touserdata(L, 1);
+
+    pool_shutdown(pool);
+    if (pool->fd[0] >= 0) {
+        close(pool->fd[0]);
+        if (pool->fd[1] != pool->fd[0])
+            close(pool->fd[1]);
+        pool->fd[0] = pool->fd[1] = -1;
+    }
+
+    return 0;
+}
+
+/* open a nonblocking completion fd, an eventfd or else a pipe */
+static int pool_open_fd(pool_t *pool)
+{
+#ifdef EFD_NONBLOCK
+    pool->fd[0] = pool->fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->fd[0] >= 0)
+        return 1;
+#endif
+    if (pipe(pool->fd))
+        return 0;
+    fcntl(pool->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool->fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(pool->fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pool->fd[1], F_SETFD, FD_CLOEXEC);
+    return 1;
+}
+
+/* push a new pool, and make it the pool of the state, the completions
+ * and the fd of the previous pool old, when given, carry over */
+static pool_t *pool_new(lua_State *L, int nthreads, size_t depth, pool_t *old)
+{
+    pool_t *pool = lua_newuserdata(L, sizeof(pool_t));
+    int i;
+
+    memset(pool, 0, sizeof(pool_t));
+    pool->fd[0] = pool->fd[1] = -1;
+    luaL_getmetatable(L, "ffi_pool");
+    lua_setmetatable(L, -2);
+
+    if (old) {
+        /* old is shut down, nothing is pushed to it anymore */
+        memcpy(pool->fd, old->fd, sizeof(pool->fd));
+        pool->ready = old->ready;
+        pool->completed = old->completed;
+        old->fd[0] = old->fd[1] = -1;
+        old->ready = old->completed = NULL;
+    } else if (!pool_open_fd(pool)) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+
+    pool->nthreads = nthreads;
+    pool->depth = depth;
+    pool->queues = calloc(nthreads, sizeof(jobqueue_t));
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->queues || !pool->threads)
+        goto error;
+    for (i = 0; i < nthreads; i++)
+        if (!(pool->queues[i].ring = malloc(depth * sizeof(job_t *))))
+            goto error;
+
+    for (i = 0; i < nthreads; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        worker_t *w = malloc(sizeof(worker_t));
+
+        if (!w)
+            break;
+        w->pool = pool;
+        w->id = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, w)) {
+            free(w);
+            break;
+        }
+    }
+    pool->started = i;
+    if (i < nthreads) {
+        pool_shutdown(pool);
+        goto error;
+    }
+
+    lua_pushlightuserdata(L, &pool_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    return pool;
+
+error:
+    for (i = 0; pool->queues && i < nthreads; i++)
+        free(pool->queues[i].ring);
+    free(pool->queues);
+    free(pool->threads);
+    pool->queues = NULL;
+    pool->threads = NULL;
+    if (old) {
+        /* give them back for the next attempt */
+        memcpy(old->fd, pool->fd, sizeof(pool->fd));
+        old->ready = pool->ready;
+        old->completed = pool->completed;
+        pool->fd[0] = pool->fd[1] = -1;
+    }
+    lua_pop(L, 1);
+    return NULL;
+}
+
+/* push the pool of the state, or nil when there is none yet */
+static pool_t *find_pool(lua_State *L)
+{
+    lua_pushlightuserdata(L, &pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    return lua_touserdata(L, -1);
+}
+
+/* push the pool of the state, created with the defaults on first use,
+ * or if replacing it failed */
+static pool_t *get_pool(lua_State *L)
+{
+    pool_t *pool = find_pool(L);
+    long n;
+
+    if (pool && pool->threads)
+        return pool;
+    lua_pop(L, 1);
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return pool_new(L, n > 0 ? n : 1, POOL_DEPTH, pool);
+}
+
+/* ffi.async_pool(nthreads[, depth]) replaces the worker pool, the jobs
+ * queued in the previous one are run first */
+static int lua_async_pool(lua_State *L)
+{
+    int nthreads = luaL_checkint(L, 1);
+    int depth = luaL_optint(L, 2, POOL_DEPTH);
+    pool_t *pool;
+
+    luaL_argcheck(L, nthreads > 0, 1, "invalid number of threads");
+    luaL_argcheck(L, depth > 0, 2, "invalid queue depth");
+
+    pool = find_pool(L);
+    if (pool)
+        pool_shutdown(pool);
+
+    lua_pushboolean(L, pool_new(L, nthreads, depth, pool) != NULL);
+    return 1;
+}
+
+static int lua_async_stats(lua_State *L)
+{
+    pool_t *pool = find_pool(L);
+    poolstats_t *s;
+
+    if (!pool || !pool->threads)
+        return 0;
+    s = &pool->stats;
+
+    lua_createtable(L, 0, 10);
+#define STAT(name, value) \
+    (lua_pushnumber(L, (lua_Number) (value)), lua_setfield(L, -2, name))
+    STAT("threads", pool->nthreads);
+    STAT("depth", pool->depth);
+    STAT("pending", __atomic_load_n(&pool->pending, __ATOMIC_RELAXED));
+    STAT("submitted", s->submitted);
+    STAT("rejected", s->rejected);
+    STAT("completed", __atomic_load_n(&s->completed, __ATOMIC_RELAXED));
+    STAT("stolen", __atomic_load_n(&s->stolen, __ATOMIC_RELAXED));
+    STAT("wait_ns", __atomic_load_n(&s->wait_ns, __ATOMIC_RELAXED));
+    STAT("wait_max_ns", __atomic_load_n(&s->wait_max_ns, __ATOMIC_RELAXED));
+    STAT("run_ns", __atomic_load_n(&s->run_ns, __ATOMIC_RELAXED));
+#undef STAT
+
+    return 1;
+}
+
+/* push the handle of a new job calling f through the cif at cidx with the
+ * lua arguments starting at base, padded with nil, followed by the pool
+ * of the state on top */
+static job_t *job_new(lua_State *L, int cidx, void *f, int base)
+{
+    cif_t *c = lua_touserdata(L, cidx);
+    int i, j, nargs = c->cif.nargs;
+    job_t *job;
+
+    job = lua_newuserdata(L, sizeof(job_t) + 16 + c->frame + sizeof(void *) * nargs);
+    job->c = c;
+    job->f = f;
+    job->pool = NULL;
+    job->done = 1;
+    job->notify = 0;
+    job->ref = job->co = LUA_NOREF;
+    job->next = NULL;
+    job->frame = (uint8_t *) ALIGN((uintptr_t) (job + 1), 16);
+    job->pargs = (void **) (job->frame + c->frame);
+
+    luaL_getmetatable(L, "ffi_async");
+    lua_setmetatable(L, -2);
+
+    /* the environment keeps alive the pool, the cif, and the strings and
+     * buffers the arguments point to */
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, -3);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, cidx);
+    lua_rawseti(L, -2, 2);
+    for (i = 0; i < nargs; i++) {
+        uint8_t *slot = job->frame + c->args[i].offset;
+
+        j = base + c->args[i].larg;
+
+        job->pargs[i] = slot;
+        if (c->args[i].op == OP_STRUCT) {
+            void *src = toptr(L, j);
+
+            if (src)
+                memcpy(slot, src, c->cif.arg_types[i]->size);
+            continue;
+        }
+        to_c(L, j, c->args[i].op, slot);
+        if (c->args[i].op == OP_POINTER
+            && (lua_type(L, j) == LUA_TSTRING || lua_type(L, j) == LUA_TUSERDATA)) {
+            lua_pushvalue(L, j);
+            lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+        }
+    }
+    if (c->nouts)
+        outs_to_c(L, c, job->frame, base);
+    lua_setfenv(L, -2);
+
+    return job;
+}
+
+static int lua_call_async(lua_State *L)
+{
+    cif_t *c = luaL_checkudata(L, 1, "ffi_cif");
+    void *f = lua_touserdata(L, 2);
+    pool_t *pool;
+    job_t *job;
+
+    luaL_argcheck(L, f != NULL, 2, "function pointer expected");
+
+    /* missing arguments are nil */
+    luaL_checkstack(L, c->nlargs + 4, "too many arguments");
+    if (lua_gettop(L) < 2 + c->nlargs)
+        lua_settop(L, 2 + c->nlargs);
+
+    if (!(pool = get_pool(L)))
+        return 0;
+    job = job_new(L, 1, f, 3);
+
+    if (!pool_submit(pool, job)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "async queue full");
+        return 2;
+    }
+
+    return 1;
+}
+
+static job_t *check_job(lua_State *L)
+{
+    return luaL_checkudata(L, 1, "ffi_async");
+}
+
+static int push_job_result(lua_State *L, job_t *job)
+{
+    cif_t *c = job->c;
+
+    if (c->rop == OP_VOID)
+        return c->nouts ? push_outs(L, c, job->frame) : 0;
+
+    if (c->rop == OP_STRUCT)
+        memcpy(lua_newuserdata(L, c->cif.rtype->size), job->frame + c->roffset,
+               c->cif.rtype->size);
+    else
+        push_c(L, c->rop, job->frame + c->roffset);
+
+    return c->nouts ? 1 + push_outs(L, c, job->frame) : 1;
+}
+
+/* handle:poll() tells whether the call has completed */
+static int lua_async_poll(lua_State *L)
+{
+    lua_pushboolean(L, __atomic_load_n(&check_job(L)->done, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+/* handle:result() returns the results of a completed call */
+static int lua_async_result(lua_State *L)
+{
+    job_t *job = check_job(L);
+
+    if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return luaL_error(L, "async call still pending");
+
+    return push_job_result(L, job);
+}
+
+/* handle:wait() blocks until the call completes and returns its results */
+static int lua_async_wait(lua_State *L)
+{
+    job_t *job = check_job(L);
+
+    job_wait(job);
+    return push_job_result(L, job);
+}
+
+/* handle:await() returns the results of a completed call, otherwise it
+ * yields the handle, the scheduler resumes the coroutine with the results
+ * of handle:result() once handle:poll() is true. Outside of a coroutine it
+ * waits. */
+static int lua_async_await(lua_State *L)
+{
+    job_t *job = check_job(L);
+
+    if (__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+        return push_job_result(L, job);
+
+    if (lua_pushthread(L)) {
+        lua_pop(L, 1);
+        job_wait(job);
+        return push_job_result(L, job);
+    }
+
+    lua_settop(L, 1);
+    return lua_yield(L, 1);
+}
+
+static int lua_async_gc(lua_State *L)
+{
+    job_t *job = lua_touserdata(L, 1);
+
+    /* the worker still uses the job and its arguments */
+    if (job->pool)
+        job_wait(job);
+
+    return 0;
+}
+
+/* coroutines: a function bound by ffi.bind_async(cif, f) called from a
+ * coroutine queues the call and yields, ffi.dispatch_completions() then
+ * resumes the coroutine with the results. The completion fd becomes
+ * readable when there are coroutines to resume. Outside of a coroutine,
+ * or when the queues are full, the call is made synchronously, so the
+ * number of calls in flight is bounded by the pool's queues. */
+
+static int lua_bound_async(lua_State *L)
+{
+    cif_t *c = lua_touserdata(L, lua_upvalueindex(1));
+    void *f = lua_touserdata(L, lua_upvalueindex(2));
+    int nargs = c->nlargs;
+    pool_t *pool;
+    job_t *job;
+
+    if (lua_pushthread(L))
+        return call_cif(L, c, f, 1, NULL);
+    lua_pop(L, 1);
+
+    luaL_checkstack(L, nargs + 4, "too many arguments");
+    if (lua_gettop(L) < nargs)
+        lua_settop(L, nargs);
+
+    if (!(pool = get_pool(L)))
+        return call_cif(L, c, f, 1, NULL);
+
+    job = job_new(L, lua_upvalueindex(1), f, 1);
+    job->notify = 1;
+    if (!pool_submit(pool, job)) {
+        lua_settop(L, nargs);
+        return call_cif(L, c, f, 1, NULL);
+    }
+
+    /* referenced until resumed */
+    job->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushthread(L);
+    job->co = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return lua_yield(L, 0);
+}
+
+static int lua_bind_async(lua_State *L)
+{
+    luaL_checkudata(L, 1, "ffi_cif");
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+
+    lua_settop(L, 2);
+    lua_pushcclosure(L, lua_bound_async, 2);
+    return 1;
+}
+
+/* ffi.completion_fd() returns the fd to watch for readability */
+static int lua_completion_fd(lua_State *L)
+{
+    pool_t *pool = get_pool(L);
+
+    if (!pool)
+        return 0;
+
+    lua_pushinteger(L, pool->fd[0]);
+    return 1;
+}
+
+/* ffi.dispatch_completions([max]) resumes up to max coroutines whose
+ * calls have completed, and returns how many. An error in a coroutine is
+ * raised again once its call is accounted for. */
+static int lua_dispatch_completions(lua_State *L)
+{
+    int max = luaL_optint(L, 1, INT_MAX);
+    pool_t *pool = find_pool(L);
+    int n = 0;
+
+    if (!pool) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    if (!pool->ready) {
+        job_t *job;
+
+        /* clear first, a push after the exchange signals again */
+        pool_clear(pool);
+        job = __atomic_exchange_n(&pool->completed, NULL, __ATOMIC_ACQUIRE);
+
+        /* the stack is newest first */
+        while (job) {
+            job_t *next = job->next;
+            job->next = pool->ready;
+            pool->ready = job;
+            job = next;
+        }
+    }
+
+    while (pool->ready && n < max) {
+        job_t *job = pool->ready;
+        lua_State *co;
+        int status, nres;
+
+        pool->ready = job->next;
+        n++;
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job->co);
+        co = lua_tothread(L, -1);
+        luaL_unref(L, LUA_REGISTRYINDEX, job->co);
+
+        /* the job stays alive on the stack until the results are pushed */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, job->ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, job->ref);
+        job->ref = job->co = LUA_NOREF;
+
+        nres = push_job_result(co, job);
+        lua_pop(L, 1);
+
+        status = lua_resume(co, nres);
+        if (status != 0 && status != LUA_YIELD) {
+            lua_xmove(co, L, 1);
+            if (pool->ready)
+                pool_signal(pool);
+            return lua_error(L);
+        }
+        /* values the coroutine yields for others are dropped */
+        lua_settop(co, 0);
+        lua_pop(L, 1);
+    }
+
+    /* what is left over keeps the fd readable */
+    if (pool->ready)
+        pool_signal(pool);
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static stringreg_t async_metastrings[] = {
+    { "type", "ffi_async" },
+    NULL
+};
+static funcreg_t async_metafuncs[] = {
+    { "__gc", lua_async_gc },
+    { "poll", lua_async_poll },
+    { "result", lua_async_result },
+    { "wait", lua_async_wait },
+    { "await", lua_async_await },
+    NULL
+};
+static funcreg_t pool_metafuncs[] = {
+    { "__gc", lua_pool_gc },
+    NULL
+};
+
+
+/* misc. function */
+/* pointer arithmetic + some fundamental types read/write functions */
+
+static int lua_ffi_tostring(lua_State *L)
+{
+    lua_pushstring(L, toptr(L, 1));
+    return 1;
+}
+
+/* ffi.string(ptr[, len]) returns the len bytes at ptr as a lua string,
+ * zeros included, or the bytes up to the first zero without len, and nil
+ * for a NULL pointer. Buffers and ffi.new blocks bound both */
+static int lua_string(lua_State *L)
+{
+    size_t size, n;
+    const char *p = (const char *) tomem(L, 1, &size);
+
+    if (!p)
+        return 0;
+    if (lua_isnoneornil(L, 2)) {
+        const char *z = size == (size_t) -1 ? p + strlen(p) : memchr(p, 0, size);
+
+        lua_pushlstring(L, p, z ? (size_t) (z - p) : size);
+    } else {
+        n = checksize(L, 2);
+        luaL_argcheck(L, n <= size, 2, "out of bounds");
+        lua_pushlstring(L, p, n);
+    }
+    return 1;
+}
+
+/* ffi.buffer(n[, s]) returns a mutable "ffi_buffer" of n bytes, starting
+ * with the bytes of s and zeroed past them. It is passed to C as a
+ * pointer to its bytes and #buf is its size, so a Tlstring argument hands
+ * C both. Lua strings can't adopt memory, ffi.string(buf, len) copies the
+ * bytes C wrote once into a string. */
+static int lua_buffer(lua_State *L)
+{
+    size_t n = checksize(L, 1), len;
+    const char *s = luaL_optlstring(L, 2, "", &len);
+    char *b;
+
+    b = lua_newuserdata(L, n);
+    if (len > n)
+        len = n;
+    memcpy(b, s, len);
+    memset(b + len, 0, n - len);
+
+    luaL_getmetatable(L, "ffi_buffer");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int lua_buffer_len(lua_State *L)
+{
+    lua_pushnumber(L, lua_objlen(L, 1));
+    return 1;
+}
+
+static funcreg_t buffer_metafuncs[] = {
+    { "__len", lua_buffer_len },
+    NULL
+};
+
+/* the pointer at i plus the offsets from i + 1 to n */
+static void *ptradd(lua_State *L, int i, int n)
+{
+    uint8_t *res = toptr(L, i++);
+
+    for ( ; i <= n; i++)
+        if (lua_isnumber(L, i) || test_int64(L, i))
+            res += (ptrdiff_t) to_int64(L, i, NULL);
+        else
+            res += (intptr_t) lua_touserdata(L, i);
+
+    return res;
+}
+
+static void *ptrsub(lua_State *L, int i)
+{
+    int n = lua_gettop(L);
+    uint8_t *res = toptr(L, i++);
+
+    for ( ; i <= n; i++)
+        if (lua_isnumber(L, i) || test_int64(L, i))
+            res -= (ptrdiff_t) to_int64(L, i, NULL);
+        else
+            res -= (intptr_t) lua_touserdata(L, i);
+
+    return res;
+}
+
+static int lua_ptradd(lua_State *L)
+{
+    lua_pushlightuserdata(L, ptradd(L, 1, lua_gettop(L)));
+    return 1;
+}
+
+static int lua_ptrsub(lua_State *L)
+{
+    lua_pushlightuserdata(L, ptrsub(L, 1));
+    return 1;
+}
+
+/* bulk memory
+ *
+ * ffi.copy, ffi.fill, ffi.compare and ffi.find work on a lightuserdata,
+ * whose size is unknown, or on a userdata or a lua string, which are
+ * bounds checked, at a byte offset read as a 64 bit integer. */
+
+/* the address off bytes into the memory at idx, where n bytes must fit */
+static uint8_t *getmem(lua_State *L, int idx, size_t off, size_t n, int writable)
+{
+    size_t size = (size_t) -1;
+    uint8_t *p;
+
+    switch (lua_type(L, idx)) {
+        case LUA_TSTRING:
+            luaL_argcheck(L, !writable, idx, "strings are immutable");
+            p = (uint8_t *) lua_tolstring(L, idx, &size);
+            break;
+        case LUA_TUSERDATA:
+        case LUA_TLIGHTUSERDATA:
+            p = tomem(L, idx, &size);
+            break;
+        default:
+            luaL_typerror(L, idx, "pointer or string");
+            return NULL;
+    }
+
+    luaL_argcheck(L, p || n == 0, idx, "NULL pointer");
+    luaL_argcheck(L, off <= size && n <= size - off, idx, "out of bounds");
+
+    return p + off;
+}
+
+/* ffi.copy(dst, src[, n[, dstoff[, srcoff]]]) copies n bytes, all of src
+ * past srcoff by default, the areas may overlap */
+static int lua_copy(lua_State *L)
+{
+    size_t n, srcoff = optsize(L, 5);
+    uint8_t *src;
+
+    if (lua_isnoneornil(L, 3)) {
+        size_t size;
+
+        if (lua_type(L, 2) == LUA_TSTRING)
+            size = lua_objlen(L, 2);
+        else
+            tomem(L, 2, &size);
+        luaL_argcheck(L, size != (size_t) -1, 3, "size expected");
+        luaL_argcheck(L, srcoff <= size, 5, "out of bounds");
+        n = size - srcoff;
+    } else
+        n = checksize(L, 3);
+    src = getmem(L, 2, srcoff, n, 0);
+
+    memmove(getmem(L, 1, optsize(L, 4), n, 1), src, n);
+    return 0;
+}
+
+/* ffi.fill(dst, n[, byte[, off]]) sets n bytes to byte, or to zero */
+static int lua_fill(lua_State *L)
+{
+    size_t n = checksize(L, 2);
+    int c = luaL_optint(L, 3, 0);
+
+    memset(getmem(L, 1, optsize(L, 4), n, 1), c, n);
+    return 0;
+}
+
+/* ffi.compare(a, b, n[, aoff[, boff]]) returns -1, 0 or 1 as the n bytes
+ * of a sort before, like or after those of b */
+static int lua_compare(lua_State *L)
+{
+    size_t n = checksize(L, 3);
+    int r = memcmp(getmem(L, 1, optsize(L, 4), n, 0), getmem(L, 2, optsize(L, 5), n, 0), n);
+
+    lua_pushinteger(L, (r > 0) - (r < 0));
+    return 1;
+}
+
+/* the first occurence of the len bytes of s in the n bytes at p */
+static const uint8_t *memfind(const uint8_t *p, size_t n, const uint8_t *s, size_t len)
+{
+    const uint8_t *end = p + n;
+
+    if (len == 0)
+        return p;
+    while (n >= len && (p = memchr(p, s[0], n - len + 1))) {
+        if (!memcmp(p + 1, s + 1, len - 1))
+            return p;
+        n = end - ++p;
+    }
+
+    return NULL;
+}
+
+/* ffi.find(ptr, n, needle[, off]) searches the n bytes at off for the
+ * string needle, or for the byte needle, and returns the offset of the
+ * first match from ptr, or nil */
+static int lua_find(lua_State *L)
+{
+    size_t n = checksize(L, 2), off = optsize(L, 4), len = 1;
+    const uint8_t *p = getmem(L, 1, off, n, 0), *q, *s;
+    uint8_t c;
+
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        c = lua_tointeger(L, 3);
+        s = &c;
+    } else
+        s = (const uint8_t *) luaL_checklstring(L, 3, &len);
+
+    if (!(q = memfind(p, n, s, len)))
+        return 0;
+    lua_pushnumber(L, off + (q - p));
+    return 1;
+}
+
+/* memory arenas
+ *
+ * An "ffi_arena" hands out scratch memory by bumping a pointer through a
+ * chunk and frees it all at once, on reset or when collected. A request
+ * that doesn't fit starts a chunk as large as all the others, and reset
+ * merges them into one, so that a steady workload bumps through a single
+ * chunk without calling malloc.
+ *
+ * ffi.new allocates typed memory owned by a small "ffi_cdata" handle,
+ * carved out of 64 KB slabs by power of 2 size classes from 16 bytes to
+ * 4 KB. A block is aligned on its class, which covers the alignment of
+ * the type, and returns to the free list of its class when its handle is
+ * collected; larger blocks are malloc'd alone. The handle stands for the
+ * block wherever a pointer is expected. */
+
+#include <pthread.h>
+
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct chunk_t {
+    struct chunk_t *next;
+    size_t size;
+} chunk_t;
+
+#define CHUNK_DATA(c) ((uint8_t *) (c) + ALIGN(sizeof(chunk_t), 16))
+
+typedef struct {
+    uint8_t *ptr, *end;         /* free part of the current chunk */
+    chunk_t *chunks;            /* the current chunk first */
+    size_t size;                /* of all the chunks */
+} arena_t;
+
+static chunk_t *chunk_new(arena_t *a, size_t size)
+{
+    chunk_t *c = size <= SIZE_MAX - ALIGN(sizeof(chunk_t), 16) ? malloc(ALIGN(sizeof(chunk_t), 16) + size) : NULL;
+
+    if (!c)
+        return NULL;
+    c->next = a->chunks;
+    c->size = size;
+    a->chunks = c;
+    a->size += size;
+    a->ptr = CHUNK_DATA(c);
+    a->end = a->ptr + size;
+
+    return c;
+}
+
+static void arena_free(arena_t *a)
+{
+    chunk_t *c, *next;
+
+    for (c = a->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    a->chunks = NULL;
+    a->ptr = a->end = NULL;
+    a->size = 0;
+}
+
+/* ffi.arena([size]) returns an arena with a first chunk of size bytes */
+static int lua_arena(lua_State *L)
+{
+    size_t size = lua_isnoneornil(L, 1) ? ARENA_CHUNK : checksize(L, 1);
+    arena_t *a = lua_newuserdata(L, sizeof(arena_t));
+
+    memset(a, 0, sizeof(arena_t));
+    luaL_getmetatable(L, "ffi_arena");
+    lua_setmetatable(L, -2);
+
+    return chunk_new(a, size) ? 1 : 0;
+}
+
+/* arena:alloc(n[, align]) returns a pointer to n uninitialized bytes
+ * aligned on align, 16 by default, valid until reset or collection */
+static int lua_arena_alloc(lua_State *L)
+{
+    arena_t *a = luaL_checkudata(L, 1, "ffi_arena");
+    size_t n = checksize(L, 2), align = luaL_optint(L, 3, 16);
+    uint8_t *p;
+
+    luaL_argcheck(L, align > 0 && !(align & (align - 1)), 3, "power of 2 expected");
+
+    p = (uint8_t *) ALIGN((uintptr_t) a->ptr, align);
+    if (!a->chunks || p > a->end || n > (size_t) (a->end - p)) {
+        if (n > SIZE_MAX - align || !chunk_new(a, n + align > a->size ? n + align : a->size))
+            return 0;
+        p = (uint8_t *) ALIGN((uintptr_t) a->ptr, align);
+    }
+    a->ptr = p + n;
+
+    lua_pushlightuserdata(L, p);
+    return 1;
+}
+
+/* arena:reset() frees everything allocated from the arena */
+static int lua_arena_reset(lua_State *L)
+{
+    arena_t *a = luaL_checkudata(L, 1, "ffi_arena");
+    size_t size = a->size;
+
+    if (a->chunks && a->chunks->next) {
+        arena_free(a);
+        chunk_new(a, size);
+    } else if (a->chunks)
+        a->ptr = CHUNK_DATA(a->chunks);
+
+    return 0;
+}
+
+/* arena:size() returns the bytes in use and the size of all chunks */
+static int lua_arena_size(lua_State *L)
+{
+    arena_t *a = luaL_checkudata(L, 1, "ffi_arena");
+    chunk_t *c;
+    size_t used = a->chunks ? a->ptr - CHUNK_DATA(a->chunks) : 0;
+
+    for (c = a->chunks ? a->chunks->next : NULL; c; c = c->next)
+        used += c->size;
+    lua_pushnumber(L, used);
+    lua_pushnumber(L, a->size);
+    return 2;
+}
+
+static int lua_arena_gc(lua_State *L)
+{
+    arena_free(lua_touserdata(L, 1));
+    return 0;
+}
+
+static funcreg_t arena_metafuncs[] = {
+    { "__gc", lua_arena_gc },
+    { "alloc", lua_arena_alloc },
+    { "reset", lua_arena_reset },
+    { "size", lua_arena_size },
+    NULL
+};
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MINSHIFT 4
+#define SLAB_MAXSHIFT 12
+#define SLAB_CLASSES (SLAB_MAXSHIFT - SLAB_MINSHIFT + 1)
+
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *slab_free[SLAB_CLASSES];  /* linked through their first word */
+
+/* a block of the size class cls, or NULL */
+static void *slab_alloc(int cls)
+{
+    size_t size = (size_t) 1 << (cls + SLAB_MINSHIFT), i;
+    uint8_t *slab;
+    void *p;
+
+    pthread_mutex_lock(&slab_lock);
+    if (!slab_free[cls]
+        && !posix_memalign((void **) &slab, (size_t) 1 << SLAB_MAXSHIFT, SLAB_SIZE)) {
+        for (i = SLAB_SIZE; i > 0; i -= size) {
+            *(void **) (slab + i - size) = slab_free[cls];
+            slab_free[cls] = slab + i - size;
+        }
+        stats.slabs++;
+    }
+    if ((p = slab_free[cls]))
+        slab_free[cls] = *(void **) p;
+    pthread_mutex_unlock(&slab_lock);
+
+    return p;
+}
+
+static void slab_release(int cls, void *p)
+{
+    pthread_mutex_lock(&slab_lock);
+    *(void **) p = slab_free[cls];
+    slab_free[cls] = p;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/* ffi.new(type[, n]) returns a handle on zeroed memory for n values of
+ * type, one by default, aligned for the type */
+static int lua_new(lua_State *L)
+{
+    ffi_type *type = luaL_checkudata(L, 1, "ffi_type");
+    lua_Number count = luaL_optnumber(L, 2, 1);
+    size_t size = type->size * (size_t) count;
+    size_t align = type->alignment > sizeof(void *) ? type->alignment : sizeof(void *);
+    cdata_t *c;
+
+    luaL_argcheck(L, count >= 0 && (!type->size || count <= (lua_Number) (SIZE_MAX / type->size)),
+                  2, "invalid count");
+
+    c = lua_newuserdata(L, sizeof(cdata_t));
+    c->ptr = NULL;
+    c->size = size;
+    for (c->cls = 0; c->cls < SLAB_CLASSES; c->cls++)
+        if (((size_t) 1 << (c->cls + SLAB_MINSHIFT)) >= (size > align ? size : align))
+            break;
+    luaL_getmetatable(L, "ffi_cdata");
+    lua_setmetatable(L, -2);
+
+    if (c->cls < SLAB_CLASSES)
+        c->ptr = slab_alloc(c->cls);
+    else if (posix_memalign(&c->ptr, align, size))
+        c->ptr = NULL;
+    if (!c->ptr)
+        return 0;
+
+    memset(c->ptr, 0, size);
+    return 1;
+}
+
+static int lua_cdata_len(lua_State *L)
+{
+    lua_pushnumber(L, ((cdata_t *) lua_touserdata(L, 1))->size);
+    return 1;
+}
+
+static int lua_cdata_gc(lua_State *L)
+{
+    cdata_t *c = lua_touserdata(L, 1);
+
+    if (!c->ptr)
+        return 0;
+    if (c->cls < SLAB_CLASSES)
+        slab_release(c->cls, c->ptr);
+    else
+        free(c->ptr);
+    c->ptr = NULL;
+
+    return 0;
+}
+
+static funcreg_t cdata_metafuncs[] = {
+    { "__gc", lua_cdata_gc },
+    { "__len", lua_cdata_len },
+    NULL
+};
+
+/* the scalar accessors take the pointer second, ffi.wint(v, ptr, ...)
+ * and ffi.rint(x, ptr, ...) whose first argument is ignored, and add the
+ * arguments after it but the last as offsets, as they always have */
+static void *accptr(lua_State *L)
+{
+    return ptradd(L, 2, lua_gettop(L) - 1);
+}
+
+#define RWTYPE(type) \
+    static int lua_w##type(lua_State *L) { *(type *)accptr(L) = lua_tonumber(L, 1); return 0; } \
+    static int lua_r##type(lua_State *L) { lua_pushnumber(L, *(type *)accptr(L)); return 1; }
+#define RWTYPE2(type) \
+    static int lua_w##type(lua_State *L) { *(type##_t *)accptr(L) = lua_tonumber(L, 1); return 0; } \
+    static int lua_r##type(lua_State *L) { lua_pushnumber(L, *(type##_t *)accptr(L)); return 1; }
+
+RWTYPE(int)
+RWTYPE(uint)
+RWTYPE2(int8)
+RWTYPE2(uint8)
+RWTYPE2(int16)
+RWTYPE2(uint16)
+RWTYPE2(int32)
+RWTYPE2(uint32)
+RWTYPE(double)
+RWTYPE(float)
+
+static int lua_wint64(lua_State *L) { *(int64_t *)accptr(L) = to_int64(L, 1, NULL); return 0; }
+static int lua_rint64(lua_State *L) { push_int64(L, *(int64_t *)accptr(L), 0); return 1; }
+static int lua_wuint64(lua_State *L) { *(uint64_t *)accptr(L) = to_int64(L, 1, NULL); return 0; }
+static int lua_ruint64(lua_State *L) { push_int64(L, *(uint64_t *)accptr(L), 1); return 1; }
+
+static int lua_wptr(lua_State *L) { *(void **)accptr(L) = toptr(L, 1); return 0; }
+static int lua_rptr(lua_State *L) { lua_pushlightuserdata(L, *(void **)accptr(L)); return 1; }
+
+/* bulk array conversion, whole arrays to and from lua tables in one call
+ *
+ * ffi.read_array(ptr, type, count[, stride]) returns a table of count
+ * values, ffi.write_array(ptr, type, tbl[, stride]) stores the values of
+ * tbl. The stride defaults to the size of the type, other strides gather
+ * or scatter a field of an array of structs. Numbers are converted by
+ * chunks through a double buffer, with SSE2 loops for packed float and
+ * int32 arrays. */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ARRAY_CHUNK 256
+
+static void array_to_double(int op, const uint8_t *src, size_t stride, double *dst, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    if (op == OP_FLOAT && stride == sizeof(float))
+        for ( ; i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps((const float *) src + i);
+            _mm_storeu_pd(dst + i, _mm_cvtps_pd(v));
+            _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+        }
+    else if ((op == OP_SINT32 || op == OP_INT) && stride == sizeof(int32_t))
+        for ( ; i + 4 <= n; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *) ((const int32_t *) src + i));
+            _mm_storeu_pd(dst + i, _mm_cvtepi32_pd(v));
+            _mm_storeu_pd(dst + i + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+        }
+#endif
+
+    for ( ; i < n; i++) {
+        const uint8_t *p = src + i * stride;
+
+        switch (op) {
+            case OP_INT: dst[i] = *(int *) p; break;
+            case OP_SINT8: dst[i] = *(int8_t *) p; break;
+            case OP_SINT16: dst[i] = *(int16_t *) p; break;
+            case OP_SINT32: dst[i] = *(int32_t *) p; break;
+            case OP_UINT8: dst[i] = *(uint8_t *) p; break;
+            case OP_UINT16: dst[i] = *(uint16_t *) p; break;
+            case OP_UINT32: dst[i] = *(uint32_t *) p; break;
+            case OP_FLOAT: dst[i] = *(float *) p; break;
+            case OP_DOUBLE: dst[i] = *(double *) p; break;
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+            case OP_LONGDOUBLE: dst[i] = *(long double *) p; break;
+#endif
+        }
+    }
+}
+
+static void array_from_double(int op, const double *src, uint8_t *dst, size_t stride, int n)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    if (op == OP_FLOAT && stride == sizeof(float))
+        for ( ; i + 4 <= n; i += 4) {
+            __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+            __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+            _mm_storeu_ps((float *) dst + i, _mm_movelh_ps(lo, hi));
+        }
+    else if ((op == OP_SINT32 || op == OP_INT) && stride == sizeof(int32_t))
+        for ( ; i + 4 <= n; i += 4) {
+            __m128i lo = _mm_cvttpd_epi32(_mm_loadu_pd(src + i));
+            __m128i hi = _mm_cvttpd_epi32(_mm_loadu_pd(src + i + 2));
+            _mm_storeu_si128((__m128i *) ((int32_t *) dst + i), _mm_unpacklo_epi64(lo, hi));
+        }
+#endif
+
+    for ( ; i < n; i++) {
+        uint8_t *p = dst + i * stride;
+
+        switch (op) {
+            case OP_INT: *(int *) p = src[i]; break;
+            case OP_SINT8: *(int8_t *) p = src[i]; break;
+            case OP_SINT16: *(int16_t *) p = src[i]; break;
+            case OP_SINT32: *(int32_t *) p = src[i]; break;
+            case OP_UINT8: *(uint8_t *) p = src[i]; break;
+            case OP_UINT16: *(uint16_t *) p = src[i]; break;
+            case OP_UINT32: *(uint32_t *) p = src[i]; break;
+            case OP_FLOAT: *(float *) p = src[i]; break;
+            case OP_DOUBLE: *(double *) p = src[i]; break;
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+            case OP_LONGDOUBLE: *(long double *) p = src[i]; break;
+#endif
+        }
+    }
+}
+
+static int lua_read_array(lua_State *L)
+{
+    uint8_t *ptr = toptr(L, 1);
+    ffi_type *type = luaL_checkudata(L, 2, "ffi_type");
+    int op = type_op(type), n = luaL_checkint(L, 3), i, j, m;
+    size_t stride = luaL_optnumber(L, 4, type->size);
+    double buf[ARRAY_CHUNK];
+
+    luaL_argcheck(L, ptr != NULL, 1, "pointer expected");
+    luaL_argcheck(L, n >= 0, 3, "negative count");
+    lua_createtable(L, n, 0);
+
+    if (op == OP_POINTER || op == OP_STRUCT || op == OP_SINT64 || op == OP_UINT64) {
+        for (i = 0; i < n; i++) {
+            push_c(L, op, ptr + i * stride);
+            lua_rawseti(L, -2, i + 1);
+        }
+        return 1;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < ARRAY_CHUNK ? n - i : ARRAY_CHUNK;
+        array_to_double(op, ptr + i * stride, stride, buf, m);
+        for (j = 0; j < m; j++) {
+            lua_pushnumber(L, buf[j]);
+            lua_rawseti(L, -2, i + j + 1);
+        }
+    }
+
+    return 1;
+}
+
+static int lua_write_array(lua_State *L)
+{
+    uint8_t *ptr = toptr(L, 1);
+    ffi_type *type = luaL_checkudata(L, 2, "ffi_type");
+    int op = type_op(type), n, i, j, m;
+    size_t stride = luaL_optnumber(L, 4, type->size);
+    double buf[ARRAY_CHUNK];
+
+    luaL_argcheck(L, ptr != NULL, 1, "pointer expected");
+    luaL_checktype(L, 3, LUA_TTABLE);
+    n = lua_objlen(L, 3);
+
+    if (op == OP_POINTER || op == OP_STRUCT || op == OP_SINT64 || op == OP_UINT64) {
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, 3, i + 1);
+            if (op == OP_STRUCT) {
+                void *src = toptr(L, -1);
+
+                if (!src)
+                    return luaL_error(L, "struct expected at index %d", i + 1);
+                memcpy(ptr + i * stride, src, type->size);
+            } else
+                to_c(L, -1, op, ptr + i * stride);
+            lua_pop(L, 1);
+        }
+        return 0;
+    }
+
+    for (i = 0; i < n; i += m) {
+        m = n - i < ARRAY_CHUNK ? n - i : ARRAY_CHUNK;
+        for (j = 0; j < m; j++) {
+            lua_rawgeti(L, 3, i + j + 1);
+            buf[j] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        array_from_double(op, buf, ptr + i * stride, stride, m);
+    }
+
+    return 0;
+}
+
+
+/* C declarations */
+/* ffi.cdef(string) parses C declarations: typedefs, struct, union and
+ * enum definitions, and function prototypes. Types and cifs are built as
+ * they are parsed and registered by name, tags as "struct tag", "union
+ * tag" and "enum tag", enum constants as numbers. The parser is a single
+ * recursive descent pass with one token of lookahead, so it runs in
+ * linear time. Preprocessor lines are skipped, except #pragma pack. Every
+ * pointer, function pointers included, is a Tpointer, and bit fields are
+ * not supported. */
+
+static char cdecl_key, ffi_key, forward_key;
+
+enum { TK_EOF = 0, TK_NAME = 256, TK_NUMBER, TK_STRING, TK_ELLIPSIS, TK_SHL, TK_SHR };
+
+typedef struct {
+    lua_State *L;
+    const char *p, *end;
+    int line, bol;              /* bol: at the beginning of a line */
+    int tok;
+    const char *name;           /* text of a TK_NAME token */
+    size_t len;
+    lua_Number num;             /* value of a TK_NUMBER token */
+    int decls, ffi;             /* stack indices of the declarations and ffi tables */
+    int forward;                /* and of the typedefs of incomplete tags */
+    const char *iprefix, *itag; /* the tag of the last incomplete base type */
+    size_t itaglen;
+    int pack[8], npack;         /* #pragma pack stack, 0 for none */
+    int attr_pack, attr_align;  /* collected from __attribute__ */
+} cparser_t;
+
+typedef struct {
+    const char *name;           /* NULL when abstract */
+    size_t len;
+    int ptr;                    /* a pointer, or a function returning one */
+    int function;               /* a function, its parameters are pushed */
+    int nparams, variadic;
+    int ndims;
+    lua_Number dims[8];         /* array dimensions, outermost first */
+} cdecl_t;
+
+#define cp_is(P, s) ((P)->tok == TK_NAME && (P)->len == sizeof(s) - 1 && \
+                     !memcmp((P)->name, s, sizeof(s) - 1))
+
+static int cp_error(cparser_t *P, const char *msg)
+{
+    lua_State *L = P->L;
+
+    if (P->tok == TK_NAME)
+        lua_pushlstring(L, P->name, P->len);
+    else if (P->tok == TK_EOF)
+        lua_pushliteral(L, "<eof>");
+    else if (P->tok == TK_NUMBER)
+        lua_pushnumber(L, P->num);
+    else if (P->tok < TK_NAME)
+        lua_pushfstring(L, "%c", P->tok);
+    else
+        lua_pushliteral(L, "?");
+
+    return luaL_error(L, "cdef:%d: %s near '%s'", P->line, msg, lua_tostring(L, -1));
+}
+
+/* #pragma pack(n), pack(push[, n]), pack(pop) and pack() */
+static void cp_pragma(cparser_t *P, const char *p, const char *end)
+{
+    int n = 0, push = 0, pop = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p < 6 || memcmp(p, "pragma", 6))
+        return;
+    for (p += 6; p < end && (*p == ' ' || *p == '\t'); p++)
+        ;
+    if (end - p < 4 || memcmp(p, "pack", 4))
+        return;
+    for (p += 4; p < end && *p != ')'; p++) {
+        if (end - p >= 4 && !memcmp(p, "push", 4))
+            push = 1, p += 3;
+        else if (end - p >= 3 && !memcmp(p, "pop", 3))
+            pop = 1, p += 2;
+        else if (*p >= '0' && *p <= '9')
+            n = n * 10 + *p - '0';
+    }
+
+    if (pop) {
+        if (P->npack > 0)
+            P->npack--;
+        return;
+    }
+    if (push && P->npack < 7)
+        P->npack++, P->pack[P->npack] = P->pack[P->npack - 1];
+    if (n || !push)
+        P->pack[P->npack] = n;
+}
+
+static void cp_next(cparser_t *P)
+{
+    const char *p = P->p, *end = P->end;
+    char *e;
+
+    for (;;) {
+        if (p == end) {
+            P->p = p;
+            P->tok = TK_EOF;
+            return;
+        }
+        if (*p == '\n') {
+            P->line++;
+            P->bol = 1;
+            p++;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\f' || *p == '\v') {
+            p++;
+        } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n')
+                p++;
+        } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+            for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++)
+                if (*p == '\n')
+                    P->line++;
+            if (p + 1 >= end)
+                luaL_error(P->L, "cdef:%d: unfinished comment", P->line);
+            p += 2;
+        } else if (*p == '#' && P->bol) {
+            const char *start = ++p;
+
+            /* the directive, with its continuation lines */
+            while (p < end && *p != '\n') {
+                if (*p == '\\' && p + 1 < end && p[1] == '\n')
+                    P->line++, p++;
+                p++;
+            }
+            cp_pragma(P, start, p);
+        } else
+            break;
+    }
+
+    P->bol = 0;
+
+    if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '_' || *p == '$') {
+        P->name = p;
+        while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+                           (*p >= '0' && *p <= '9') || *p == '_' || *p == '$'))
+            p++;
+        P->len = p - P->name;
+        P->tok = TK_NAME;
+    } else if ((*p >= '0' && *p <= '9') || (*p == '.' && p + 1 < end && p[1] >= '0' && p[1] <= '9')) {
+        /* the input is a lua string, so it is 0 terminated */
+        if (*p == '0' && p + 1 < end && p[1] >= '0' && p[1] <= '7')
+            P->num = strtoul(p, &e, 8);
+        else if (*p == '0' && p + 1 < end && (p[1] == 'x' || p[1] == 'X'))
+            P->num = strtoull(p, &e, 16);
+        else
+            P->num = strtod(p, &e);
+        for (p = e; p < end && (*p == 'u' || *p == 'U' || *p == 'l' || *p == 'L' ||
+                                *p == 'f' || *p == 'F'); p++)
+            ;
+        P->tok = TK_NUMBER;
+    } else if (*p == '\'') {
+        p++;
+        if (p < end && *p == '\\') {
+            p++;
+            switch (p < end ? *p : 0) {
+                case 'n': P->num = '\n'; break;
+                case 't': P->num = '\t'; break;
+                case 'r': P->num = '\r'; break;
+                case '0': P->num = 0; break;
+                default: P->num = (unsigned char) *p;
+            }
+        } else
+            P->num = p < end ? (unsigned char) *p : 0;
+        for (p++; p < end && *p != '\''; p++)
+            ;
+        p++;
+        P->tok = TK_NUMBER;
+    } else if (*p == '"') {
+        for (p++; p < end && *p != '"'; p++)
+            if (*p == '\\')
+                p++;
+        p++;
+        P->tok = TK_STRING;
+    } else if (*p == '.' && end - p >= 3 && p[1] == '.' && p[2] == '.') {
+        p += 3;
+        P->tok = TK_ELLIPSIS;
+    } else if (*p == '<' && p + 1 < end && p[1] == '<') {
+        p += 2;
+        P->tok = TK_SHL;
+    } else if (*p == '>' && p + 1 < end && p[1] == '>') {
+        p += 2;
+        P->tok = TK_SHR;
+    } else
+        P->tok = (unsigned char) *p++;
+
+    if (p > end)
+        p = end;
+    P->p = p;
+}
+
+/* the token after the current one */
+static int cp_peek(cparser_t *P)
+{
+    cparser_t save = *P;
+    int tok;
+
+    cp_next(P);
+    tok = P->tok;
+    *P = save;
+
+    return tok;
+}
+
+static int cp_accept(cparser_t *P, int tok)
+{
+    if (P->tok != tok)
+        return 0;
+    cp_next(P);
+    return 1;
+}
+
+static void cp_expect(cparser_t *P, int tok, const char *msg)
+{
+    if (!cp_accept(P, tok))
+        cp_error(P, msg);
+}
+
+/* push the declaration of the current name, or of "prefix name" */
+static void cp_lookup(cparser_t *P, const char *prefix)
+{
+    lua_State *L = P->L;
+
+    if (prefix) {
+        lua_pushstring(L, prefix);
+        lua_pushlstring(L, P->name, P->len);
+        lua_concat(L, 2);
+    } else
+        lua_pushlstring(L, P->name, P->len);
+    lua_rawget(L, P->decls);
+}
+
+/* decls[prefix .. name] = the value on top, which stays there */
+static void cp_register(cparser_t *P, const char *prefix, const char *name, size_t len)
+{
+    lua_State *L = P->L;
+
+    if (prefix) {
+        lua_pushstring(L, prefix);
+        lua_pushlstring(L, name, len);
+        lua_concat(L, 2);
+    } else
+        lua_pushlstring(L, name, len);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, P->decls);
+}
+
+/* a declared type, false for an incomplete struct or union */
+static int is_type(lua_State *L, int idx)
+{
+    return lua_type(L, idx) == LUA_TBOOLEAN || is_udata(L, idx, "ffi_type");
+}
+
+#define is_incomplete(L, idx) (lua_type(L, idx) == LUA_TBOOLEAN)
+
+/* typedefs of a tag declared before its definition, "typedef struct foo
+ * foo_t;", are incomplete until the tag is completed. forward[tag] lists
+ * the typedefs waiting on the tag and forward[name] is the tag of such a
+ * typedef, so completing a tag patches decls[name] of its own typedefs
+ * only */
+static void cp_forward(cparser_t *P, const char *name, size_t len)
+{
+    lua_State *L = P->L;
+    int key = lua_gettop(L) + 1;
+
+    if (P->iprefix) {
+        lua_pushstring(L, P->iprefix);
+        lua_pushlstring(L, P->itag, P->itaglen);
+        lua_concat(L, 2);
+    } else
+        lua_pushlstring(L, P->itag, P->itaglen);
+
+    lua_pushlstring(L, name, len);
+    lua_pushvalue(L, key);
+    lua_rawset(L, P->forward);
+
+    lua_pushvalue(L, key);
+    lua_rawget(L, P->forward);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, P->forward);
+    }
+    lua_pushlstring(L, name, len);
+    lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+    lua_settop(L, key - 1);
+}
+
+/* the tag prefix .. name was completed with the type on top */
+static void cp_complete(cparser_t *P, const char *prefix, const char *name, size_t len)
+{
+    lua_State *L = P->L;
+    int type = lua_gettop(L), key = type + 1, i, n;
+
+    lua_pushstring(L, prefix);
+    lua_pushlstring(L, name, len);
+    lua_concat(L, 2);
+    lua_pushvalue(L, key);
+    lua_rawget(L, P->forward);
+    if (!lua_istable(L, -1)) {
+        lua_settop(L, type);
+        return;
+    }
+
+    n = lua_objlen(L, -1);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, key + 1, i);
+        /* unless it was declared again since */
+        lua_pushvalue(L, -1);
+        lua_rawget(L, P->forward);
+        if (lua_rawequal(L, -1, key)) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, P->decls);
+            if (is_incomplete(L, -1)) {
+                lua_pushvalue(L, -3);
+                lua_pushvalue(L, type);
+                lua_rawset(L, P->decls);
+            }
+            lua_pop(L, 1);
+            lua_pushvalue(L, -2);
+            lua_pushnil(L);
+            lua_rawset(L, P->forward);
+        }
+        lua_pop(L, 2);
+    }
+
+    lua_pushvalue(L, key);
+    lua_pushnil(L);
+    lua_rawset(L, P->forward);
+    lua_settop(L, type);
+}
+
+static void cp_push_base(cparser_t *P, const char *name)
+{
+    lua_getfield(P->L, P->ffi, name);
+}
+
+/* __attribute__((...)), __declspec(...) and asm("..."), packed and
+ * aligned(n) are remembered for struct definitions */
+static lua_Number cp_expr(cparser_t *P, int prec);
+
+static void cp_attribute(cparser_t *P)
+{
+    int depth = 0;
+
+    cp_next(P);
+    if (P->tok != '(')
+        return;
+
+    do {
+        if (P->tok == '(')
+            depth++;
+        else if (P->tok == ')')
+            depth--;
+        else if (P->tok == TK_EOF)
+            cp_error(P, "unfinished attribute");
+        else if (cp_is(P, "packed") || cp_is(P, "__packed__"))
+            P->attr_pack = 1;
+        else if ((cp_is(P, "aligned") || cp_is(P, "__aligned__")) && cp_peek(P) == '(') {
+            cp_next(P);
+            cp_next(P);
+            P->attr_align = cp_expr(P, 0);
+            cp_expect(P, ')', "')' expected");
+            continue;
+        }
+        cp_next(P);
+    } while (depth > 0);
+}
+
+/* skip qualifiers and attributes, return 1 if there were some */
+static int cp_skip_qualifiers(cparser_t *P)
+{
+    int any = 0;
+
+    for (;; any = 1) {
+        if (P->tok != TK_NAME)
+            return any;
+        if (cp_is(P, "const") || cp_is(P, "volatile") || cp_is(P, "restrict") ||
+            cp_is(P, "__restrict") || cp_is(P, "__restrict__") || cp_is(P, "__const") ||
+            cp_is(P, "__volatile__") || cp_is(P, "__extension__") || cp_is(P, "_Noreturn") ||
+            cp_is(P, "extern") || cp_is(P, "static") || cp_is(P, "inline") ||
+            cp_is(P, "__inline") || cp_is(P, "__inline__") || cp_is(P, "register") ||
+            cp_is(P, "auto") || cp_is(P, "__cdecl") || cp_is(P, "__stdcall"))
+            cp_next(P);
+        else if (cp_is(P, "__attribute__") || cp_is(P, "__attribute") ||
+                 cp_is(P, "__declspec") || cp_is(P, "__asm__") || cp_is(P, "__asm") ||
+                 cp_is(P, "asm"))
+            cp_attribute(P);
+        else
+            return any;
+    }
+}
+
+static int cp_is_type(cparser_t *P);
+static int cp_specifiers(cparser_t *P);
+static void cp_declarator(cparser_t *P, cdecl_t *d, int abstract, int keep);
+static void cp_apply(cparser_t *P, cdecl_t *d);
+
+static lua_Number cp_unary(cparser_t *P)
+{
+    lua_State *L = P->L;
+    lua_Number n;
+
+    if (cp_accept(P, '-'))
+        return -cp_unary(P);
+    if (cp_accept(P, '+'))
+        return cp_unary(P);
+    if (cp_accept(P, '~'))
+        return ~(long long) cp_unary(P);
+    if (cp_accept(P, '!'))
+        return !cp_unary(P);
+
+    if (cp_accept(P, '(')) {
+        if (cp_is_type(P)) {
+            cdecl_t d;
+
+            /* a cast, types are all the same here */
+            cp_specifiers(P);
+            cp_declarator(P, &d, 1, 0);
+            lua_pop(L, 1);
+            cp_expect(P, ')', "')' expected");
+            return cp_unary(P);
+        }
+        n = cp_expr(P, 0);
+        cp_expect(P, ')', "')' expected");
+        return n;
+    }
+
+    if (P->tok == TK_NUMBER) {
+        n = P->num;
+        cp_next(P);
+        return n;
+    }
+
+    if (cp_is(P, "sizeof")) {
+        cdecl_t d;
+
+        cp_next(P);
+        cp_expect(P, '(', "'(' expected");
+        cp_specifiers(P);
+        cp_declarator(P, &d, 1, 0);
+        cp_apply(P, &d);
+        n = ((ffi_type *) lua_touserdata(L, -1))->size;
+        lua_pop(L, 1);
+        cp_expect(P, ')', "')' expected");
+        return n;
+    }
+
+    if (P->tok == TK_NAME) {
+        cp_lookup(P, NULL);
+        if (lua_type(L, -1) != LUA_TNUMBER)
+            cp_error(P, "constant expected");
+        n = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        cp_next(P);
+        return n;
+    }
+
+    return cp_error(P, "constant expected");
+}
+
+/* integer constant expression of operators binding tighter than prec */
+static lua_Number cp_expr(cparser_t *P, int prec)
+{
+    lua_Number a = cp_unary(P), b;
+
+    for (;;) {
+        int op = P->tok, p;
+
+        switch (op) {
+            case '*': case '/': case '%': p = 10; break;
+            case '+': case '-': p = 9; break;
+            case TK_SHL: case TK_SHR: p = 8; break;
+            case '&': p = 5; break;
+            case '^': p = 4; break;
+            case '|': p = 3; break;
+            default: return a;
+        }
+        if (p <= prec)
+            return a;
+
+        cp_next(P);
+        b = cp_expr(P, p);
+        switch (op) {
+            case '*': a *= b; break;
+            case '/': if (b) a = (long long) a / (long long) b; break;
+            case '%': if (b) a = (long long) a % (long long) b; break;
+            case '+': a += b; break;
+            case '-': a -= b; break;
+            case TK_SHL: a = (long long) a << (int) b; break;
+            case TK_SHR: a = (long long) a >> (int) b; break;
+            case '&': a = (long long) a & (long long) b; break;
+            case '^': a = (long long) a ^ (long long) b; break;
+            case '|': a = (long long) a | (long long) b; break;
+        }
+    }
+}
+
+static int cp_is_basic(cparser_t *P)
+{
+    return cp_is(P, "void") || cp_is(P, "char") || cp_is(P, "short") || cp_is(P, "int") ||
+        cp_is(P, "long") || cp_is(P, "float") || cp_is(P, "double") || cp_is(P, "signed") ||
+        cp_is(P, "__signed__") || cp_is(P, "unsigned") || cp_is(P, "_Bool") || cp_is(P, "bool");
+}
+
+/* whether the current token starts a type name */
+static int cp_is_type(cparser_t *P)
+{
+    int res;
+
+    if (P->tok != TK_NAME)
+        return 0;
+    if (cp_is_basic(P) || cp_is(P, "struct") || cp_is(P, "union") || cp_is(P, "enum") ||
+        cp_is(P, "const") || cp_is(P, "volatile"))
+        return 1;
+
+    cp_lookup(P, NULL);
+    res = is_type(P->L, -1);
+    lua_pop(P->L, 1);
+
+    return res;
+}
+
+/* struct or union definition or reference, pushes the type, or false
+ * for an incomplete one */
+static void cp_aggregate(cparser_t *P, int kind)
+{
+    lua_State *L = P->L;
+    const char *prefix = kind == KIND_UNION ? "union " : "struct ";
+    const char *tag = NULL;
+    size_t taglen = 0;
+    int base, nargs;
+
+    cp_next(P);
+    P->attr_pack = P->attr_align = 0;
+    cp_skip_qualifiers(P);
+
+    if (P->tok == TK_NAME) {
+        tag = P->name;
+        taglen = P->len;
+        if (P->tok == TK_NAME && cp_peek(P) != '{') {
+            cp_lookup(P, prefix);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushboolean(L, 0);
+            }
+            if (is_incomplete(L, -1))
+                P->iprefix = prefix, P->itag = tag, P->itaglen = taglen;
+            cp_next(P);
+            return;
+        }
+        cp_next(P);
+    }
+    cp_expect(P, '{', "'{' expected");
+
+    base = lua_gettop(L) + 1;
+    lua_pushcfunction(L, kind == KIND_UNION ? lua_union_new : lua_struct_new);
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, P->pack[P->npack]);
+    lua_setfield(L, -2, "pack");
+
+    while (!cp_accept(P, '}')) {
+        int mbase;
+
+        if (P->tok == TK_EOF)
+            cp_error(P, "'}' expected");
+        luaL_checkstack(L, 8, "too many fields");
+
+        cp_specifiers(P);
+        mbase = lua_gettop(L);
+
+        /* an anonymous struct or union member */
+        if (cp_accept(P, ';')) {
+            if (is_incomplete(L, mbase))
+                cp_error(P, "incomplete type");
+            continue;
+        }
+
+        for (;;) {
+            cdecl_t d;
+
+            cp_declarator(P, &d, 0, 0);
+            if (P->tok == ':')
+                cp_error(P, "bit fields are not supported");
+            cp_skip_qualifiers(P);
+
+            lua_pushlstring(L, d.name, d.len);
+            lua_pushvalue(L, mbase);
+            cp_apply(P, &d);
+            if (!field_ok(lua_touserdata(L, -1)))
+                cp_error(P, "invalid field type");
+
+            if (!cp_accept(P, ','))
+                break;
+        }
+        cp_expect(P, ';', "';' expected");
+        lua_remove(L, mbase);
+    }
+
+    P->attr_pack = P->attr_align = 0;
+    cp_skip_qualifiers(P);
+    if (P->attr_pack) {
+        lua_pushinteger(L, 1);
+        lua_setfield(L, base + 1, "pack");
+    }
+    if (P->attr_align) {
+        lua_pushinteger(L, P->attr_align);
+        lua_setfield(L, base + 1, "align");
+    }
+
+    nargs = lua_gettop(L) - base;
+    lua_call(L, nargs, 1);
+
+    if (tag) {
+        cp_register(P, prefix, tag, taglen);
+        cp_complete(P, prefix, tag, taglen);
+    }
+}
+
+/* enum definition or reference, pushes Tint */
+static void cp_enum(cparser_t *P)
+{
+    lua_State *L = P->L;
+    lua_Number value = 0;
+
+    cp_next(P);
+    cp_skip_qualifiers(P);
+
+    if (P->tok == TK_NAME) {
+        cp_push_base(P, "Tint");
+        cp_register(P, "enum ", P->name, P->len);
+        lua_pop(L, 1);
+        cp_next(P);
+    }
+
+    if (cp_accept(P, '{')) {
+        while (!cp_accept(P, '}')) {
+            const char *name = P->name;
+            size_t len = P->len;
+
+            if (P->tok != TK_NAME)
+                cp_error(P, "enum constant expected");
+            cp_next(P);
+            if (cp_accept(P, '='))
+                value = cp_expr(P, 0);
+
+            lua_pushnumber(L, value++);
+            cp_register(P, NULL, name, len);
+            lua_pop(L, 1);
+
+            if (!cp_accept(P, ',')) {
+                cp_expect(P, '}', "'}' expected");
+                break;
+            }
+        }
+    }
+
+    cp_push_base(P, "Tint");
+}
+
+/* declaration specifiers, pushes the base type or false for an
+ * incomplete struct, returns whether it is a typedef */
+static int cp_specifiers(cparser_t *P)
+{
+    lua_State *L = P->L;
+    int is_typedef = 0, found = 0, basic = 0;
+    int nvoid = 0, nchar = 0, nshort = 0, nlong = 0, nfloat = 0, ndouble = 0, nbool = 0;
+    int nsigned = 0, nunsigned = 0;
+
+    P->itag = NULL;
+    for (;;) {
+        if (cp_skip_qualifiers(P))
+            continue;
+        if (P->tok != TK_NAME)
+            break;
+
+        if (cp_is(P, "typedef")) {
+            is_typedef = 1;
+        } else if (cp_is(P, "struct") && !found && !basic) {
+            cp_aggregate(P, KIND_STRUCT);
+            found = 1;
+            continue;
+        } else if (cp_is(P, "union") && !found && !basic) {
+            cp_aggregate(P, KIND_UNION);
+            found = 1;
+            continue;
+        } else if (cp_is(P, "enum") && !found && !basic) {
+            cp_enum(P);
+            found = 1;
+            continue;
+        } else if (cp_is_basic(P) && !found) {
+            basic = 1;
+            if (cp_is(P, "void")) nvoid++;
+            else if (cp_is(P, "char")) nchar++;
+            else if (cp_is(P, "short")) nshort++;
+            else if (cp_is(P, "long")) nlong++;
+            else if (cp_is(P, "float")) nfloat++;
+            else if (cp_is(P, "double")) ndouble++;
+            else if (cp_is(P, "_Bool") || cp_is(P, "bool")) nbool++;
+            else if (cp_is(P, "unsigned")) nunsigned++;
+            else if (cp_is(P, "signed") || cp_is(P, "__signed__")) nsigned++;
+        } else if (!found && !basic) {
+            cp_lookup(P, NULL);
+            if (!is_type(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            if (is_incomplete(L, -1)) {
+                /* a forward typedef, its tag is forward[name] */
+                lua_pushlstring(L, P->name, P->len);
+                lua_rawget(L, P->forward);
+                P->iprefix = NULL;
+                P->itag = lua_tolstring(L, -1, &P->itaglen);
+                lua_pop(L, 1);
+            }
+            found = 1;
+        } else
+            break;
+
+        cp_next(P);
+    }
+
+    if (found)
+        return is_typedef;
+    if (!basic)
+        cp_error(P, "type expected");
+
+    if (nvoid)
+        cp_push_base(P, "Tvoid");
+    else if (nbool)
+        cp_push_base(P, "Tuchar");
+    else if (nchar)
+        cp_push_base(P, nunsigned ? "Tuchar" : nsigned ? "Tschar" : "Tchar");
+    else if (nfloat)
+        cp_push_base(P, "Tfloat");
+    else if (ndouble)
+        cp_push_base(P, nlong ? "Tlongdouble" : "Tdouble");
+    else if (nshort)
+        cp_push_base(P, nunsigned ? "Tushort" : "Tsshort");
+    else if (nlong >= 2)
+        cp_push_base(P, nunsigned ? "Tuint64" : "Tsint64");
+    else if (nlong)
+        cp_push_base(P, nunsigned ? "Tulong" : "Tslong");
+    else
+        cp_push_base(P, nunsigned ? "Tuint" : "Tsint");
+
+    return is_typedef;
+}
+
+/* parameter list after the '(', pushes the parameter types when keep */
+static int cp_params(cparser_t *P, int keep, int *variadic)
+{
+    lua_State *L = P->L;
+    int n = 0;
+
+    *variadic = 0;
+    if (cp_accept(P, ')'))
+        return 0;
+
+    for (;;) {
+        cdecl_t d;
+        ffi_type *type;
+
+        if (cp_accept(P, TK_ELLIPSIS)) {
+            *variadic = 1;
+            break;
+        }
+        luaL_checkstack(L, 4, "too many parameters");
+
+        cp_specifiers(P);
+        cp_declarator(P, &d, 1, 0);
+
+        /* (void) */
+        type = lua_touserdata(L, -1);
+        if (n == 0 && type && type->type == FFI_TYPE_VOID && !d.ptr && !d.function &&
+            !d.ndims && P->tok == ')') {
+            lua_pop(L, 1);
+            break;
+        }
+
+        /* arrays and functions decay to pointers */
+        if (d.ndims || d.function)
+            d.ptr = 1, d.ndims = 0, d.function = 0;
+        cp_apply(P, &d);
+
+        if (keep)
+            n++;
+        else
+            lua_pop(L, 1);
+
+        if (!cp_accept(P, ','))
+            break;
+    }
+    cp_expect(P, ')', "')' expected");
+
+    return n;
+}
+
+/* a declarator, abstract when allowed, the parameters of a function
+ * declarator are pushed when keep */
+static void cp_declarator(cparser_t *P, cdecl_t *d, int abstract, int keep)
+{
+    int pointers = 0, nested = 0, n, variadic;
+
+    memset(d, 0, sizeof(cdecl_t));
+
+    while (P->tok == '*' || P->tok == '^' || P->tok == '&') {
+        pointers++;
+        cp_next(P);
+        cp_skip_qualifiers(P);
+    }
+
+    /* (*name) is nested, any other ( starts the parameters */
+    if (P->tok == '(' && ((n = cp_peek(P)) == '*' || n == '^')) {
+        cp_next(P);
+        cp_declarator(P, d, abstract, keep);
+        cp_expect(P, ')', "')' expected");
+        nested = 1;
+    } else if (P->tok == TK_NAME) {
+        d->name = P->name;
+        d->len = P->len;
+        cp_next(P);
+    } else if (!abstract)
+        cp_error(P, "identifier expected");
+
+    if (nested) {
+        /* pointer to function or array, or function returning one */
+        d->ptr = 1;
+        while (P->tok == '(' || P->tok == '[') {
+            if (cp_accept(P, '('))
+                cp_params(P, 0, &variadic);
+            else {
+                cp_next(P);
+                while (P->tok != ']' && P->tok != TK_EOF)
+                    cp_next(P);
+                cp_expect(P, ']', "']' expected");
+            }
+        }
+        cp_skip_qualifiers(P);
+        return;
+    }
+
+    d->ptr = pointers > 0;
+    for (;;) {
+        if (cp_accept(P, '[')) {
+            if (d->ndims == 8)
+                cp_error(P, "too many array dimensions");
+            d->dims[d->ndims++] = P->tok == ']' ? 0 : cp_expr(P, 0);
+            cp_expect(P, ']', "']' expected");
+        } else if (P->tok == '(' && !d->function && !d->ndims) {
+            cp_next(P);
+            d->function = 1;
+            d->nparams = cp_params(P, keep, &d->variadic);
+        } else
+            break;
+    }
+    cp_skip_qualifiers(P);
+}
+
+/* replace the base type on top with the type of the declarator d */
+static void cp_apply(cparser_t *P, cdecl_t *d)
+{
+    lua_State *L = P->L;
+    int i;
+
+    if (d->ptr || d->function) {
+        lua_pop(L, 1);
+        cp_push_base(P, "Tpointer");
+        return;
+    }
+    if (is_incomplete(L, -1))
+        cp_error(P, "incomplete type");
+
+    for (i = d->ndims - 1; i >= 0; i--) {
+        ffi_type *type = lua_touserdata(L, -1);
+
+        if (!field_ok(type))
+            cp_error(P, "invalid array element type");
+        if (!(d->dims[i] >= 0 && d->dims[i] * type->size < (lua_Number) SIZE_MAX))
+            cp_error(P, "array too large");
+        lua_pushcfunction(L, lua_array_new);
+        lua_insert(L, -2);
+        lua_pushnumber(L, d->dims[i]);
+        lua_call(L, 2, 1);
+    }
+}
+
+static void cp_parse(cparser_t *P)
+{
+    lua_State *L = P->L;
+
+    cp_next(P);
+    while (P->tok != TK_EOF) {
+        int top = lua_gettop(L), is_typedef;
+        const char *iprefix, *itag;
+        size_t itaglen;
+
+        if (cp_accept(P, ';'))
+            continue;
+
+        is_typedef = cp_specifiers(P);
+        iprefix = P->iprefix, itag = P->itag, itaglen = P->itaglen;
+        if (cp_accept(P, ';')) {
+            lua_settop(L, top);
+            continue;
+        }
+
+        for (;;) {
+            int base = lua_gettop(L);
+            cdecl_t d;
+
+            cp_declarator(P, &d, 0, !is_typedef);
+
+            if (is_typedef) {
+                /* a typedef of an incomplete struct is incomplete too */
+                lua_pushvalue(L, base);
+                if (!is_incomplete(L, -1) || d.ptr || d.function || d.ndims)
+                    cp_apply(P, &d);
+                else if (itag) {
+                    P->iprefix = iprefix, P->itag = itag, P->itaglen = itaglen;
+                    cp_forward(P, d.name, d.len);
+                }
+                cp_register(P, NULL, d.name, d.len);
+            } else if (d.function) {
+                int i;
+
+                luaL_checkstack(L, 8, "too many parameters");
+
+                /* base, abi, return type, parameters */
+                lua_pushlightuserdata(L, (void *) FFI_DEFAULT_ABI);
+                lua_insert(L, base + 1);
+                lua_pushvalue(L, base);
+                if (d.ptr)
+                    d.function = 0, cp_apply(P, &d);
+                else if (is_incomplete(L, -1))
+                    cp_error(P, "incomplete type");
+                lua_insert(L, base + 2);
+
+                for (i = base + 2; i <= lua_gettop(L); i++)
+                    if (!by_value(lua_touserdata(L, i)))
+                        cp_error(P, "union or packed struct passed by value");
+                if (!new_cif(L, base + 1, -1))
+                    cp_error(P, "invalid prototype");
+                /* variadic functions are their fixed part, for ffi.call_var */
+                if (d.variadic) {
+                    lua_createtable(L, 1, 0);
+                    lua_insert(L, -2);
+                    lua_rawseti(L, -2, 1);
+                }
+                cp_register(P, NULL, d.name, d.len);
+
+                /* inline definitions */
+                if (P->tok == '{') {
+                    int depth = 0;
+
+                    do {
+                        if (P->tok == '{')
+                            depth++;
+                        else if (P->tok == '}')
+                            depth--;
+                        else if (P->tok == TK_EOF)
+                            cp_error(P, "'}' expected");
+                        cp_next(P);
+                    } while (depth > 0);
+                    lua_settop(L, top);
+                    goto next;
+                }
+            } else if (cp_accept(P, '=')) {
+                /* variables are ignored, and so are their initializers */
+                while (P->tok != ',' && P->tok != ';' && P->tok != TK_EOF)
+                    cp_next(P);
+            }
+
+            lua_settop(L, base);
+            if (!cp_accept(P, ','))
+                break;
+        }
+        cp_expect(P, ';', "';' expected");
+        lua_settop(L, top);
+next:
+        ;
+    }
+}
+
+static void cp_init(cparser_t *P, lua_State *L, const char *s, size_t len)
+{
+    memset(P, 0, sizeof(cparser_t));
+    P->L = L;
+    P->p = s;
+    P->end = s + len;
+    P->line = P->bol = 1;
+
+    lua_pushlightuserdata(L, &cdecl_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    P->decls = lua_gettop(L);
+    lua_pushlightuserdata(L, &ffi_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    P->ffi = lua_gettop(L);
+    lua_pushlightuserdata(L, &forward_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    P->forward = lua_gettop(L);
+}
+
+static int lua_cdef(lua_State *L)
+{
+    cparser_t P;
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+
+    cp_init(&P, L, s, len);
+    cp_parse(&P);
+
+    return 0;
+}
+
+/* ffi.type(name) returns the type of a C type name, such as "size_t",
+ * "struct foo" or "char *[4]" */
+static int lua_ffi_type(lua_State *L)
+{
+    cparser_t P;
+    cdecl_t d;
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+
+    cp_init(&P, L, s, len);
+    cp_next(&P);
+    cp_specifiers(&P);
+    cp_declarator(&P, &d, 1, 0);
+    if (P.tok != TK_EOF)
+        cp_error(&P, "end of type expected");
+    if (is_incomplete(L, -1) && !d.ptr && !d.function)
+        return 0;
+    cp_apply(&P, &d);
+
+    return 1;
+}
+
+/* ffi.cif(name) returns the cif of a declared function, the fixed part
+ * of it for a variadic function */
+static int lua_cif(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    lua_pushlightuserdata(L, &cdecl_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1))
+        lua_rawgeti(L, -1, 1);
+
+    return is_udata(L, -1, "ffi_cif");
+}
+
+/* type names known without a declaration */
+static stringreg_t cdecl_builtins[] = {
+    { "size_t", "Tulong" },
+    { "ssize_t", "Tslong" },
+    { "ptrdiff_t", "Tslong" },
+    { "intptr_t", "Tslong" },
+    { "uintptr_t", "Tulong" },
+    { "off_t", "Tslong" },
+    { "time_t", "Tslong" },
+    { "wchar_t", "Tsint32" },
+    { "int8_t", "Tsint8" },
+    { "uint8_t", "Tuint8" },
+    { "int16_t", "Tsint16" },
+    { "uint16_t", "Tuint16" },
+    { "int32_t", "Tsint32" },
+    { "uint32_t", "Tuint32" },
+    { "int64_t", "Tsint64" },
+    { "uint64_t", "Tuint64" },
+    { "va_list", "Tpointer" },
+    { "__builtin_va_list", "Tpointer" },
+    NULL
+};
+
+
+/* binding snapshots */
+/* ffi.save_bindings(path) writes the declarations of ffi.cdef to a file
+ * that ffi.load_bindings(path) maps back in, without parsing and with a
+ * single pass over the file. The format is native and meant as a cache
+ * for the same build, an array of 32 bit words after the header:
+ *
+ *   strings   the names, 0 terminated and padded to a word
+ *   types     BASE name | STRUCT/UNION pack align n (name type)*n |
+ *             ARRAY count type, a type only refers to earlier ones
+ *   entries   name kind, then a type, a cif (abi rtype n type*n), a
+ *             double in two words, or nothing for an incomplete type
+ *
+ * Names are string offsets, ~0 for none, and types are 1 based indices.
+ * Symbols are not stored, lib.name still resolves them on first use. */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAP_MAGIC "LFFB"
+#define SNAP_VERSION 1
+#define SNAP_NONE 0xffffffffU
+
+enum { SNAP_BASE, SNAP_STRUCT, SNAP_UNION, SNAP_ARRAY };
+enum { SNAP_TYPE, SNAP_CIF, SNAP_VARCIF, SNAP_NUMBER, SNAP_INCOMPLETE };
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t ptrsize;
+    uint32_t ntypes, nentries;
+    uint32_t strsize;           /* in bytes, a multiple of 4 */
+} snaphdr_t;
+
+/* stack indices of the tables of ffi.save_bindings */
+typedef struct {
+    lua_State *L;
+    int decls, ffi;
+    int names;                  /* base type userdata -> name */
+    int index;                  /* type userdata -> index */
+    int order;                  /* index -> type userdata */
+    int strings;                /* string -> offset */
+    int strlist;                /* the strings in order */
+    uint32_t ntypes, nentries, strsize;
+    size_t nwords;              /* of the types and entries */
+    uint32_t *out;
+} snapsave_t;
+
+/* offset of the string at idx, added to the string table if needed */
+static uint32_t snap_string(snapsave_t *S, int idx)
+{
+    lua_State *L = S->L;
+    uint32_t off;
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, S->strings);
+    if (!lua_isnil(L, -1)) {
+        off = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        return off;
+    }
+    lua_pop(L, 1);
+
+    off = S->strsize;
+    S->strsize += lua_objlen(L, idx) + 1;
+    lua_pushvalue(L, idx);
+    lua_pushnumber(L, off);
+    lua_rawset(L, S->strings);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, S->strlist, lua_objlen(L, S->strlist) + 1);
+
+    return off;
+}
+
+/* give an index to the type at idx after the types it refers to */
+static void snap_collect(snapsave_t *S, int idx)
+{
+    lua_State *L = S->L;
+    ffi_type *type = lua_touserdata(L, idx);
+
+    lua_pushvalue(L, idx);
+    lua_rawget(L, S->index);
+    if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+
+    luaL_checkstack(L, 4, "types nested too deep");
+    if (type->type == FFI_TYPE_STRUCT) {
+        struct_t *s = (struct_t *) type;
+        int i;
+
+        lua_getfenv(L, idx);
+        for (i = 1; i <= s->nfields; i++) {
+            lua_rawgeti(L, -1, i);
+            snap_collect(S, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+        /* field names */
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            if (lua_type(L, -2) == LUA_TSTRING)
+                snap_string(S, lua_gettop(L) - 1);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+        S->nwords += s->kind == KIND_ARRAY ? 3 : 4 + 2 * s->nfields;
+    } else {
+        lua_pushvalue(L, idx);
+        lua_rawget(L, S->names);
+        if (lua_isnil(L, -1))
+            luaL_error(L, "unknown base type");
+        snap_string(S, lua_gettop(L));
+        lua_pop(L, 1);
+        S->nwords += 2;
+    }
+
+    lua_pushvalue(L, idx);
+    lua_pushnumber(L, ++S->ntypes);
+    lua_rawset(L, S->index);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, S->order, S->ntypes);
+}
+
+static uint32_t snap_lookup(snapsave_t *S, int idx, int table)
+{
+    uint32_t res;
+
+    lua_pushvalue(S->L, idx);
+    lua_rawget(S->L, table);
+    res = lua_tonumber(S->L, -1);
+    lua_pop(S->L, 1);
+
+    return res;
+}
+
+#define snap_put(S, v) (*(S)->out++ = (v))
+
+/* the cif of a declared function at the top, NULL for other values */
+static cif_t *snap_cif(lua_State *L, int *kind)
+{
+    *kind = SNAP_CIF;
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        lua_replace(L, -2);
+        *kind = SNAP_VARCIF;
+    }
+
+    return is_udata(L, -1, "ffi_cif") ? lua_touserdata(L, -1) : NULL;
+}
+
+static void snap_type(snapsave_t *S, int idx)
+{
+    lua_State *L = S->L;
+    ffi_type *type = lua_touserdata(L, idx);
+    struct_t *s = (struct_t *) type;
+    uint32_t *names;
+    int i;
+
+    if (type->type != FFI_TYPE_STRUCT) {
+        snap_put(S, SNAP_BASE);
+        lua_pushvalue(L, idx);
+        lua_rawget(L, S->names);
+        snap_put(S, snap_lookup(S, lua_gettop(L), S->strings));
+        lua_pop(L, 1);
+        return;
+    }
+
+    lua_getfenv(L, idx);
+    if (s->kind == KIND_ARRAY) {
+        snap_put(S, SNAP_ARRAY);
+        snap_put(S, s->count);
+        lua_rawgeti(L, -1, 1);
+        snap_put(S, snap_lookup(S, lua_gettop(L), S->index));
+        lua_pop(L, 2);
+        return;
+    }
+
+    names = alloca(sizeof(uint32_t) * (s->nfields + 1));
+    for (i = 0; i <= s->nfields; i++)
+        names[i] = SNAP_NONE;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        if (lua_type(L, -2) == LUA_TSTRING)
+            names[lua_tointeger(L, -1)] = snap_lookup(S, lua_gettop(L) - 1, S->strings);
+        lua_pop(L, 1);
+    }
+
+    snap_put(S, s->kind == KIND_UNION ? SNAP_UNION : SNAP_STRUCT);
+    snap_put(S, s->pack);
+    snap_put(S, s->align);
+    snap_put(S, s->nfields);
+    for (i = 1; i <= s->nfields; i++) {
+        snap_put(S, names[i]);
+        lua_rawgeti(L, -1, i);
+        snap_put(S, snap_lookup(S, lua_gettop(L), S->index));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+static int lua_save_bindings(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    snapsave_t S;
+    snaphdr_t *hdr;
+    char *strings;
+    size_t len;
+    FILE *file;
+    int i, n, ok;
+
+    memset(&S, 0, sizeof(snapsave_t));
+    S.L = L;
+    lua_settop(L, 1);
+    lua_pushlightuserdata(L, &cdecl_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    S.decls = lua_gettop(L);
+    lua_pushlightuserdata(L, &ffi_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    S.ffi = lua_gettop(L);
+    for (i = 0; i < 5; i++)
+        lua_newtable(L);
+    S.names = S.ffi + 1;
+    S.index = S.ffi + 2;
+    S.order = S.ffi + 3;
+    S.strings = S.ffi + 4;
+    S.strlist = S.ffi + 5;
+
+    for (i = 0; types[i].name; i++) {
+        lua_getfield(L, S.ffi, types[i].name);
+        lua_pushstring(L, types[i].name);
+        lua_rawset(L, S.names);
+    }
+
+    /* strings and types first, their offsets and indices are needed */
+    lua_pushnil(L);
+    while (lua_next(L, S.decls)) {
+        int kind;
+        cif_t *c;
+
+        S.nentries++;
+        snap_string(&S, lua_gettop(L) - 1);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            S.nwords += 4;
+        } else if (lua_type(L, -1) == LUA_TBOOLEAN) {
+            S.nwords += 2;
+        } else if (is_type(L, -1)) {
+            snap_collect(&S, lua_gettop(L));
+            S.nwords += 3;
+        } else if ((c = snap_cif(L, &kind))) {
+            /* the return and argument types */
+            lua_getfenv(L, -1);
+            S.nwords += 4 + lua_objlen(L, -1);
+            for (i = 1; i <= (int) lua_objlen(L, -1); i++) {
+                lua_rawgeti(L, -1, i);
+                snap_collect(&S, lua_gettop(L));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    S.strsize = ALIGN(S.strsize, sizeof(uint32_t));
+
+    /* the whole file, the sizes are known now */
+    len = sizeof(snaphdr_t) + S.strsize + sizeof(uint32_t) * S.nwords;
+    hdr = lua_newuserdata(L, len);
+    memcpy(hdr->magic, SNAP_MAGIC, 4);
+    hdr->version = SNAP_VERSION;
+    hdr->ptrsize = sizeof(void *);
+    hdr->ntypes = S.ntypes;
+    hdr->nentries = S.nentries;
+    hdr->strsize = S.strsize;
+
+    strings = (char *) (hdr + 1);
+    memset(strings, 0, S.strsize);
+    n = lua_objlen(L, S.strlist);
+    for (i = 1; i <= n; i++) {
+        size_t l;
+        const char *s;
+
+        lua_rawgeti(L, S.strlist, i);
+        s = lua_tolstring(L, -1, &l);
+        memcpy(strings, s, l + 1);
+        strings += l + 1;
+        lua_pop(L, 1);
+    }
+    S.out = (uint32_t *) ((char *) (hdr + 1) + S.strsize);
+
+    for (i = 1; i <= (int) S.ntypes; i++) {
+        lua_rawgeti(L, S.order, i);
+        snap_type(&S, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, S.decls)) {
+        int kind;
+        cif_t *c;
+
+        snap_put(&S, snap_lookup(&S, lua_gettop(L) - 1, S.strings));
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            lua_Number d = lua_tonumber(L, -1);
+            uint32_t w[2];
+
+            memcpy(w, &d, sizeof(w));
+            snap_put(&S, SNAP_NUMBER);
+            snap_put(&S, w[0]);
+            snap_put(&S, w[1]);
+        } else if (lua_type(L, -1) == LUA_TBOOLEAN) {
+            snap_put(&S, SNAP_INCOMPLETE);
+        } else if (is_type(L, -1)) {
+            snap_put(&S, SNAP_TYPE);
+            snap_put(&S, snap_lookup(&S, lua_gettop(L), S.index));
+        } else if ((c = snap_cif(L, &kind))) {
+            snap_put(&S, kind);
+            snap_put(&S, c->cif.abi);
+            lua_getfenv(L, -1);
+            snap_put(&S, lua_objlen(L, -1) - 1);
+            for (i = 1; i <= (int) lua_objlen(L, -1); i++) {
+                lua_rawgeti(L, -1, i);
+                snap_put(&S, snap_lookup(&S, lua_gettop(L), S.index));
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+
+    file = fopen(path, "wb");
+    if (!file)
+        return 0;
+    ok = fwrite(hdr, 1, len, file) == len;
+    ok = fclose(file) == 0 && ok;
+
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
+/* sets the declarations of the snapshot at hdr of size bytes, returns 0
+ * if it is invalid. The whole snapshot is read before any declaration is
+ * set, so an invalid one leaves them untouched */
+static int snap_load(lua_State *L, int decls, int ffi, const snaphdr_t *hdr, size_t size)
+{
+    const char *strings = (const char *) (hdr + 1);
+    const uint32_t *p = (const uint32_t *) (strings + hdr->strsize);
+    const uint32_t *end = (const uint32_t *) ((const char *) hdr + size);
+    int types, entries, top = lua_gettop(L);
+    uint32_t i, j;
+
+#define SNAP_NEXT(v) do { if (p == end) return 0; (v) = *p++; } while (0)
+#define SNAP_STR(v) do { SNAP_NEXT(v); if ((v) >= hdr->strsize) return 0; } while (0)
+#define SNAP_TYPEREF(v, n) do { SNAP_NEXT(v); if ((v) < 1 || (v) > (n)) return 0; } while (0)
+
+    lua_newtable(L);
+    types = lua_gettop(L);
+    lua_newtable(L);
+    entries = lua_gettop(L);
+
+    for (i = 1; i <= hdr->ntypes; i++) {
+        uint32_t kind, name, t, n, pack, align, count;
+        ffi_type *type;
+        struct_t *s;
+
+        SNAP_NEXT(kind);
+        switch (kind) {
+            case SNAP_BASE:
+                SNAP_STR(name);
+                lua_getfield(L, ffi, strings + name);
+                if (!is_type(L, -1))
+                    return 0;
+                break;
+
+            case SNAP_STRUCT:
+            case SNAP_UNION:
+                SNAP_NEXT(pack);
+                SNAP_NEXT(align);
+                SNAP_NEXT(n);
+                if (n > (uint32_t) (end - p) / 2)
+                    return 0;
+                s = struct_alloc(L, kind == SNAP_UNION ? KIND_UNION : KIND_STRUCT, n, n);
+                s->pack = pack;
+                s->align = align;
+                lua_getfenv(L, -1);
+                for (j = 0; j < n; j++) {
+                    SNAP_NEXT(name);
+                    SNAP_TYPEREF(t, i - 1);
+                    lua_rawgeti(L, types, t);
+                    struct_setfield(s, j, lua_touserdata(L, -1));
+                    if (!field_ok(s->fields[j].type))
+                        return 0;
+                    lua_rawseti(L, -2, j + 1);
+                    if (name != SNAP_NONE) {
+                        if (name >= hdr->strsize)
+                            return 0;
+                        lua_pushstring(L, strings + name);
+                        lua_pushinteger(L, j + 1);
+                        lua_rawset(L, -3);
+                    }
+                }
+                lua_pop(L, 1);
+                struct_layout(s);
+                break;
+
+            case SNAP_ARRAY:
+                SNAP_NEXT(count);
+                SNAP_TYPEREF(t, i - 1);
+                lua_rawgeti(L, types, t);
+                type = lua_touserdata(L, -1);
+                if (!field_ok(type) || (type->size && count > SIZE_MAX / type->size))
+                    return 0;
+                array_new(L, lua_gettop(L), count);
+                lua_remove(L, -2);
+                break;
+
+            default:
+                return 0;
+        }
+        lua_rawseti(L, types, i);
+    }
+
+    for (i = 0; i < hdr->nentries; i++) {
+        uint32_t name, kind, abi, n, t, w[2];
+        lua_Number d;
+        int base;
+
+        SNAP_STR(name);
+        SNAP_NEXT(kind);
+        switch (kind) {
+            case SNAP_TYPE:
+                SNAP_TYPEREF(t, hdr->ntypes);
+                lua_rawgeti(L, types, t);
+                break;
 
-static int lua_closure_new(lua_State *L)
-{
-    closure_t *c;
+            case SNAP_CIF:
+            case SNAP_VARCIF:
+                SNAP_NEXT(abi);
+                SNAP_NEXT(n);
+                if (n > (uint32_t) (end - p))
+                    return 0;
+                luaL_checkstack(L, n + 8, "too many arguments");
+                base = lua_gettop(L) + 1;
+                lua_pushlightuserdata(L, (void *) (intptr_t) abi);
+                for (j = 0; j <= n; j++) {
+                    SNAP_TYPEREF(t, hdr->ntypes);
+                    lua_rawgeti(L, types, t);
+                }
+                if (!new_cif(L, base, -1))
+                    return 0;
+                lua_replace(L, base);
+                lua_settop(L, base);
+                if (kind == SNAP_VARCIF) {
+                    lua_createtable(L, 1, 0);
+                    lua_insert(L, -2);
+                    lua_rawseti(L, -2, 1);
+                }
+                break;
 
-    c = lua_newuserdata(L, sizeof(closure_t));
-    if (!c)
-        return 0;
+            case SNAP_NUMBER:
+                SNAP_NEXT(w[0]);
+                SNAP_NEXT(w[1]);
+                memcpy(&d, w, sizeof(d));
+                lua_pushnumber(L, d);
+                break;
 
-    c->L = L;
-    c->writable = ffi_closure_alloc(sizeof(ffi_closure), &c->f);
+            case SNAP_INCOMPLETE:
+                lua_pushboolean(L, 0);
+                break;
 
-    if (!c->writable)
-        return 0;
+            default:
+                return 0;
+        }
+        lua_setfield(L, entries, strings + name);
+    }
 
-    luaL_getmetatable(L, "ffi_closure");
+#undef SNAP_NEXT
+#undef SNAP_STR
+#undef SNAP_TYPEREF
 
-    lua_pushlightuserdata(L, c);
-    lua_pushvalue(L, 2);
-    lua_rawset(L, -3);
-    
-    /* make sure the cif isn't gc'ed during the closure's lifetime */
-    lua_pushlightuserdata(L, c->writable);
-    lua_pushvalue(L, 1);
-    lua_rawset(L, -3);
-    
-    lua_setmetatable(L, -2);
-    
-    if (ffi_prep_closure(c->writable, (ffi_cif *) luaL_checkudata(L, 1, "ffi_cif"),
-                         lua_ffi_closure, c) != FFI_OK)
+    if (p != end)
         return 0;
 
+    lua_pushnil(L);
+    while (lua_next(L, entries)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, decls);
+    }
+
+    lua_settop(L, top);
     return 1;
 }
 
-static int lua_closure_gc(lua_State *L)
-{
-    closure_t *c = lua_touserdata(L, 1);
-
-    ffi_closure_free(c->writable);
+/* a snapshot mapping, unmapped by __gc when a load raises an error */
+typedef struct {
+    void *map;
+    size_t size;
+} snapmap_t;
 
-    lua_getmetatable(L, 1);
-    lua_pushlightuserdata(L, c);
-    lua_pushnil(L);
-    lua_rawset(L, -3);
+static void snapmap_unmap(snapmap_t *m)
+{
+    if (m->map)
+        munmap(m->map, m->size);
+    m->map = NULL;
+}
 
-    if (c->writable) {
-        /* unreference the cif */
-        lua_pushlightuserdata(L, c->writable);
-        lua_pushnil(L);
-        lua_rawset(L, -3);
-    }
-    
+static int lua_snapmap_gc(lua_State *L)
+{
+    snapmap_unmap(lua_touserdata(L, 1));
     return 0;
 }
 
-static int lua_closure_index(lua_State *L)
+static funcreg_t snapmap_metafuncs[] = {
+    { "__gc", lua_snapmap_gc },
+    NULL
+};
+
+/* ffi.load_bindings(path) returns the number of declarations loaded, or
+ * nil if the file can't be read or isn't a snapshot of this build */
+static int lua_load_bindings(lua_State *L)
 {
-    closure_t *c = lua_touserdata(L, 1);
-    const char *index = lua_tostring(L, 2);
+    const char *path = luaL_checkstring(L, 1);
+    const snaphdr_t *hdr;
+    struct stat st;
+    size_t size;
+    uint32_t nentries;
+    snapmap_t *m;
+    void *map;
+    int fd, ok;
 
-    if (!strcmp(index, "func")) {
-        /* hmmm, under x86 linux, if I try to call c->f, it crashes, so
-         * I simply return c->writable, is it be a problem under other architectures ? */
-        lua_pushlightuserdata(L, c->writable);
-        //lua_pushlightuserdata(L, c->f);
-        return 1;
-    } else if (!strcmp(index, "cif")) {
-        lua_getmetatable(L, 1);
-        lua_pushlightuserdata(L, c->writable);
-        lua_rawget(L, -2);
-        return 1;
-    } else if (!strcmp(index, "writable")) {
-        lua_pushlightuserdata(L, c->writable);
-        return 1;
+    lua_settop(L, 1);
+    m = lua_newuserdata(L, sizeof(snapmap_t));
+    m->map = NULL;
+    luaL_getmetatable(L, "ffi_snapmap");
+    lua_setmetatable(L, -2);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(snaphdr_t)) {
+        close(fd);
+        return 0;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+    m->map = map;
+    m->size = size;
+
+    hdr = map;
+    ok = !memcmp(hdr->magic, SNAP_MAGIC, 4) && hdr->version == SNAP_VERSION &&
+        hdr->ptrsize == sizeof(void *) && hdr->strsize % sizeof(uint32_t) == 0 &&
+        hdr->strsize <= size - sizeof(snaphdr_t) &&
+        (size - sizeof(snaphdr_t) - hdr->strsize) % sizeof(uint32_t) == 0 &&
+        (hdr->strsize == 0 || ((const char *) (hdr + 1))[hdr->strsize - 1] == 0);
+
+    if (ok) {
+        lua_pushlightuserdata(L, &cdecl_key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        lua_pushlightuserdata(L, &ffi_key);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        ok = snap_load(L, 3, 4, hdr, size);
     }
+    nentries = hdr->nentries;
+    snapmap_unmap(m);
 
-    return 0;
+    if (!ok)
+        return 0;
+    lua_pushnumber(L, nentries);
+    return 1;
 }
 
 
-static stringreg_t closure_metastrings[] = {
-    { "type", "ffi_closure" },
-    NULL
-};
-static funcreg_t closure_metafuncs[] = {
-    { "__gc", lua_closure_gc },
-    { "__index", lua_closure_index },
+/* dynamic library handling (dlfnc under unix only for now) */
+/* TODO put this in a separate lib */
+
+#include <dlfcn.h>
+
+/* dlopen flags, ffi.RTLD_NOW + ffi.RTLD_LOCAL combines them */
+static intreg_t dl_flags[] = {
+    { "RTLD_LAZY", RTLD_LAZY },
+    { "RTLD_NOW", RTLD_NOW },
+    { "RTLD_GLOBAL", RTLD_GLOBAL },
+    { "RTLD_LOCAL", RTLD_LOCAL },
+#ifdef RTLD_NODELETE
+    { "RTLD_NODELETE", RTLD_NODELETE },
+#endif
+#ifdef RTLD_NOLOAD
+    { "RTLD_NOLOAD", RTLD_NOLOAD },
+#endif
+#ifdef RTLD_DEEPBIND
+    { "RTLD_DEEPBIND", RTLD_DEEPBIND },
+#endif
     NULL
 };
 
+/* the handle cache: libraries are dlopened once per canonical path and
+ * flags, and refcounted by their lib userdata. A name with a '/' is a
+ * file, its path is its realpath (or the name when it doesn't resolve).
+ * A bare soname is looked up by dlopen on its search path, not in the
+ * current directory, so its path is the name itself, and a handle that
+ * is already open under another name is shared. Names already seen are
+ * hashed, so opening one again is a lookup, except relative paths, which
+ * change meaning with the current directory. Names resolving to the same
+ * file share a dlobj_t. Handles reaching no reference are closed unless
+ * ffi.lib_resident(true) keeps them open. The cache is process wide,
+ * under dl_lock, and counted in ffi.stats(). */
 
-/* misc. function */
-/* pointer arithmetic + some fundamental types read/write functions */
+#define DLCACHE_SIZE 64
 
-static int lua_ffi_tostring(lua_State *L)
-{
-    lua_pushstring(L, lua_touserdata(L, 1));
-    return 1;
-}
+typedef struct dlobj {
+    struct dlobj *next;
+    char *path;
+    int flags;
+    void *h;
+    int refs;
+} dlobj_t;
 
-static void *ptradd(lua_State *L, int i)
-{
-    int n = lua_gettop(L);
-    uint8_t *res = lua_touserdata(L, i++);
+typedef struct dlname {
+    struct dlname *next;        /* in its bucket */
+    char *name;
+    int flags;
+    dlobj_t *obj;
+} dlname_t;
 
-    for ( ; i < n; i++)
-        if (lua_isnumber(L, i))
-            res += (int) lua_tonumber(L, i);
-        else
-            res += (int) lua_touserdata(L, i);
+static pthread_mutex_t dl_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    return res;
-}
+static struct {
+    dlname_t *names[DLCACHE_SIZE];
+    dlobj_t *objs;
+    int resident;
+} dl;
 
-static void *ptrsub(lua_State *L, int i)
+typedef struct {
+    void *h;                    /* must come first, see lua_get_symbol */
+    dlobj_t *obj;
+} lib_t;
+
+static unsigned dl_hash(const char *name, int flags)
 {
-    int n = lua_gettop(L);
-    uint8_t *res = lua_touserdata(L, i++);
+    unsigned h = 2166136261U ^ flags;
 
-    for ( ; i < n; i++)
-        if (lua_isnumber(L, i))
-            res -= (int) lua_tonumber(L, i);
-        else
-            res -= (int) lua_touserdata(L, i);
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619U;
 
-    return res;
+    return h % DLCACHE_SIZE;
 }
 
-static int lua_ptradd(lua_State *L)
+static char *dl_strdup(const char *s)
 {
-    lua_pushlightuserdata(L, ptradd(L, 1));
-    return 1;
+    char *d = malloc(strlen(s) + 1);
+
+    return d ? strcpy(d, s) : NULL;
 }
 
-static int lua_ptrsub(lua_State *L)
+/* a referenced object for name, NULL if it can't be opened */
+static dlobj_t *dl_acquire(const char *name, int flags)
 {
-    lua_pushlightuserdata(L, ptrsub(L, 1));
-    return 1;
+    unsigned b = dl_hash(name, flags);
+    int file = strchr(name, '/') != NULL, relative = file && *name != '/';
+    char buf[PATH_MAX];
+    const char *path = name;
+    dlname_t *n;
+    dlobj_t *obj;
+    void *h;
+
+    pthread_mutex_lock(&dl_lock);
+
+    for (n = relative ? NULL : dl.names[b]; n; n = n->next)
+        if (n->flags == flags && !strcmp(n->name, name)) {
+            n->obj->refs++;
+            stats.lib_hits++;
+            pthread_mutex_unlock(&dl_lock);
+            return n->obj;
+        }
+
+    if (file && realpath(name, buf))
+        path = buf;
+    for (obj = dl.objs; obj; obj = obj->next)
+        if (obj->flags == flags && !strcmp(obj->path, path))
+            break;
+
+#ifdef RTLD_NOLOAD
+    if (!obj && !file && (h = dlopen(*name ? name : NULL, flags | RTLD_NOLOAD))) {
+        /* a soname of a library already open under another name */
+        for (obj = dl.objs; obj; obj = obj->next)
+            if (obj->flags == flags && obj->h == h)
+                break;
+        dlclose(h);
+    }
+#endif
+
+    if (obj) {
+        stats.lib_hits++;
+    } else {
+        h = dlopen(*name ? name : NULL, flags);
+        if (!h)
+            goto fail;
+        stats.lib_opens++;
+
+        obj = malloc(sizeof(dlobj_t));
+        if (!obj || !(obj->path = dl_strdup(path))) {
+            free(obj);
+            dlclose(h);
+            goto fail;
+        }
+        obj->flags = flags;
+        obj->h = h;
+        obj->refs = 0;
+        obj->next = dl.objs;
+        dl.objs = obj;
+        stats.libs++;
+    }
+
+    /* remember the name, it is enough to skip realpath next time */
+    n = relative ? NULL : malloc(sizeof(dlname_t));
+    if (n && (n->name = dl_strdup(name))) {
+        n->flags = flags;
+        n->obj = obj;
+        n->next = dl.names[b];
+        dl.names[b] = n;
+    } else
+        free(n);
+
+    obj->refs++;
+    pthread_mutex_unlock(&dl_lock);
+    return obj;
+
+fail:
+    pthread_mutex_unlock(&dl_lock);
+    return NULL;
 }
 
-#define RWTYPE(type) \
-    static int lua_w##type(lua_State *L) { *(type *)ptradd(L, 2) = lua_tonumber(L, 1); return 0; } \
-    static int lua_r##type(lua_State *L) { lua_pushnumber(L, *(type *)ptradd(L, 2)); return 1; }
-#define RWTYPE2(type) \
-    static int lua_w##type(lua_State *L) { *(type##_t *)ptradd(L, 2) = lua_tonumber(L, 1); return 0; } \
-    static int lua_r##type(lua_State *L) { lua_pushnumber(L, *(type##_t *)ptradd(L, 2)); return 1; }
+static void dl_release(dlobj_t *obj)
+{
+    dlobj_t **po;
+    int i;
 
-RWTYPE(int)
-RWTYPE(uint)
-RWTYPE2(int8)
-RWTYPE2(uint8)
-RWTYPE2(int16)
-RWTYPE2(uint16)
-RWTYPE2(int32)
-RWTYPE2(uint32)
-RWTYPE2(int64)
-RWTYPE2(uint64)
-RWTYPE(double)
-RWTYPE(float)
+    pthread_mutex_lock(&dl_lock);
 
-static int lua_wptr(lua_State *L) { *(void **)ptradd(L, 2) = lua_touserdata(L, 1); return 0; }
-static int lua_rptr(lua_State *L) { lua_pushlightuserdata(L, *(void **)ptradd(L, 2)); return 1; }
+    if (--obj->refs > 0 || dl.resident) {
+        pthread_mutex_unlock(&dl_lock);
+        return;
+    }
 
+    /* forget the names and the object */
+    for (i = 0; i < DLCACHE_SIZE; i++) {
+        dlname_t **pn = &dl.names[i], *n;
 
-/* dynamic library handling (dlfnc under unix only for now) */
-/* TODO put this in a separate lib */
+        while ((n = *pn))
+            if (n->obj == obj) {
+                *pn = n->next;
+                free(n->name);
+                free(n);
+            } else
+                pn = &n->next;
+    }
+    for (po = &dl.objs; *po != obj; po = &(*po)->next)
+        ;
+    *po = obj->next;
+    stats.libs--;
+    stats.lib_closes++;
 
-#include <dlfcn.h>
+    pthread_mutex_unlock(&dl_lock);
+
+    dlclose(obj->h);
+    free(obj->path);
+    free(obj);
+}
+
+/* ffi.open_lib([path[, flags]]), flags default to RTLD_LAZY, which is
+ * also added to flags that have neither RTLD_LAZY nor RTLD_NOW */
 static int lua_open_lib(lua_State *L)
 {
-    void *h, **ph;
+    const char *name = luaL_optstring(L, 1, "");
+    int flags = luaL_optint(L, 2, RTLD_LAZY);
+    dlobj_t *obj;
+    lib_t *lib;
 
-    /* TODO make the mode configurable */
-    h = dlopen(lua_tostring(L, 1), RTLD_LAZY);
-    if (!h)
-        return 0;
+    if (!(flags & (RTLD_LAZY | RTLD_NOW)))
+        flags |= RTLD_LAZY;
 
-    ph = lua_newuserdata(L, sizeof(void *));
-    *ph = h;
+    /* allocated first, so a failure doesn't leak a reference */
+    lib = lua_newuserdata(L, sizeof(lib_t));
+    obj = dl_acquire(name, flags);
+    if (!obj)
+        return 0;
+    lib->h = obj->h;
+    lib->obj = obj;
     luaL_getmetatable(L, "ffi_lib");
     lua_setmetatable(L, -2);
 
+    /* the bindings of lib.name */
+    lua_newtable(L);
+    lua_setfenv(L, -2);
+
     return 1;
 }
 
 static int lua_lib_gc(lua_State *L)
 {
-    void *h = *(void * *) lua_touserdata(L, 1);
+    lib_t *lib = lua_touserdata(L, 1);
 
-    printf("closing lib %p\n", h);
-    dlclose(h);
+    dl_release(lib->obj);
 
     return 0;
 }
 
+/* ffi.lib_resident(on) sets whether unreferenced libraries stay open,
+ * so that opening them again costs no dlopen, returns the previous
+ * setting */
+static int lua_lib_resident(lua_State *L)
+{
+    int on = lua_toboolean(L, 1);
+
+    pthread_mutex_lock(&dl_lock);
+    lua_pushboolean(L, dl.resident);
+    dl.resident = on;
+    pthread_mutex_unlock(&dl_lock);
+
+    return 1;
+}
+
 static int lua_get_symbol(lua_State *L)
 {
     void *h;
@@ -664,8 +5944,137 @@ static int lua_get_symbol(lua_State *L)
     return 1;
 }
 
+/* push the function name declared with ffi.cdef bound to its symbol in
+ * the lib at idx, or the value of an enum constant, return 0 if there is
+ * no such declaration or symbol. A binding keeps the lib alive. */
+static int lib_resolve(lua_State *L, int idx, const char *name)
+{
+    void *h = *(void * *) lua_touserdata(L, idx), *f;
+    int variadic;
+
+    lua_pushlightuserdata(L, &cdecl_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_getfield(L, -1, name);
+    lua_remove(L, -2);
+    if (lua_type(L, -1) == LUA_TNUMBER)
+        return 1;
+
+    variadic = lua_istable(L, -1);
+    if (variadic)
+        lua_rawgeti(L, -1, 1);
+    if (!is_udata(L, -1, "ffi_cif"))
+        return 0;
+
+    f = dlsym(h, name);
+    if (!f)
+        return 0;
+
+    lua_pushlightuserdata(L, f);
+    lua_pushvalue(L, idx);
+    lua_pushcclosure(L, variadic ? lua_bound_call_var : lua_bound_call, 3);
+
+    return 1;
+}
+
+/* lib.name resolves name with lib_resolve, bindings are cached in the
+ * environment table of lib */
+static int lua_lib_index(lua_State *L)
+{
+    luaL_checkudata(L, 1, "ffi_lib");
+    luaL_checkstring(L, 2);
+    lua_getfenv(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    if (!lib_resolve(L, 1, lua_tostring(L, 2)))
+        return 0;
+
+    /* env[name] = binding */
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 3);
+
+    return 1;
+}
+
+/* namespaces: ffi.load(path) returns a table whose __index resolves a
+ * name with lib_resolve and stores the result in the table, so that
+ * later lookups are plain table hits. The lib is an upvalue of __index. */
+static int lua_ns_index(lua_State *L)
+{
+    const char *name = lua_tostring(L, 2);
+
+    if (!name || !lib_resolve(L, lua_upvalueindex(1), name))
+        return 0;
+
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+
+    return 1;
+}
+
+/* ffi.load([path[, flags]]), the main program without a path, flags as
+ * for ffi.open_lib */
+static int lua_load(lua_State *L)
+{
+    luaL_optstring(L, 1, NULL);
+    lua_settop(L, 2);
+    if (!lua_open_lib(L))
+        return 0;
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, 3);
+    lua_pushcclosure(L, lua_ns_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+/* ffi.get_symbols(lib, { names }) returns a table of the symbols found
+ * by name, and the list of the missing names or nil if none is missing */
+static int lua_get_symbols(lua_State *L)
+{
+    void *h = *(void * *) luaL_checkudata(L, 1, "ffi_lib"), *f;
+    int i, n, nmissing = 0;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_objlen(L, 2);
+    lua_settop(L, 2);
+    lua_createtable(L, 0, n);
+    lua_newtable(L);
+
+    for (i = 1; i <= n; i++) {
+        const char *name;
+
+        lua_rawgeti(L, 2, i);
+        name = lua_tostring(L, -1);
+        luaL_argcheck(L, name, 2, "symbol names expected");
+
+        f = dlsym(h, name);
+        if (f) {
+            lua_pushlightuserdata(L, f);
+            lua_rawset(L, 3);
+        } else
+            lua_rawseti(L, 4, ++nmissing);
+    }
+
+    if (!nmissing) {
+        lua_pushnil(L);
+        lua_replace(L, 4);
+    }
+
+    return 2;
+}
+
 static funcreg_t lib_metafuncs[] = {
     { "__gc", lua_lib_gc },
+    { "__index", lua_lib_index },
     NULL
 };
 static stringreg_t lib_metastrings[] = {
@@ -678,12 +6087,55 @@ static stringreg_t lib_metastrings[] = {
 
 static luaL_reg func[] = {
     REG(prep_cif),
+    REG(prep_cif_var),
+    REG(call_var),
+    REG(stats),
+    REG(int64),
+    REG(uint64),
+    { "tonumber", lua_ffi_tonumber },
+    REG(cdef),
+    { "type", lua_ffi_type },
+    REG(cif),
+    REG(save_bindings),
+    REG(load_bindings),
     REG(struct_new),
+    REG(union_new),
+    REG(array_new),
+    REG(sizeof),
+    REG(alignof),
+    REG(offsetof),
+    REG(view),
     { "call", lua_ffi_call },
+    REG(call_into),
+    REG(bind),
+    REG(call_many),
+    REG(jit),
     REG(closure_new),
+    REG(poll_callbacks),
+    REG(call_async),
+    REG(async_pool),
+    REG(async_stats),
+    REG(bind_async),
+    REG(completion_fd),
+    REG(dispatch_completions),
     REG(open_lib),
+    REG(load),
     REG(get_symbol),
+    REG(get_symbols),
+    REG(lib_resident),
     { "tostring", lua_ffi_tostring },
+    REG(string),
+    REG(buffer),
+    REG(copy),
+    REG(fill),
+    REG(compare),
+    REG(find),
+    REG(ptradd),
+    REG(ptrsub),
+    REG(arena),
+    REG(new),
+    { "Tout", lua_out_type },
+    { "Tinout", lua_inout_type },
     REG(rint), REG(wint),
     REG(rint8), REG(wint8),
     REG(rint16), REG(wint16),
@@ -696,6 +6148,7 @@ static luaL_reg func[] = {
     REG(rfloat), REG(wfloat),
     REG(rdouble), REG(wdouble),
     REG(rptr), REG(wptr),
+    REG(read_array), REG(write_array),
     NULL
 };
 
@@ -721,6 +6174,17 @@ static void register_funcs(lua_State *L, funcreg_t *reg, int index)
     }
 }
 
+static void register_ints(lua_State *L, intreg_t *reg, int index)
+{
+    int i;
+
+    for (i = 0; reg[i].name; i++) {
+        lua_pushstring(L, reg[i].name);
+        lua_pushinteger(L, reg[i].value);
+        lua_rawset(L, index-2);
+    }
+}
+
 static void register_strings(lua_State *L, stringreg_t *reg, int index)
 {
     int i;
@@ -738,6 +6202,7 @@ int luaopen_luaffi(lua_State *L)
 
     if (!luaL_newmetatable(L, "ffi_cif"))
         goto error;
+    register_funcs(L, cif_metafuncs, -1);
     register_strings(L, cif_metastrings, -1);
     lua_settop(L, -2); /* pop */
     
@@ -752,12 +6217,76 @@ int luaopen_luaffi(lua_State *L)
     register_strings(L, closure_metastrings, -1);
     lua_settop(L, -2); /* pop */
     
+    if (!luaL_newmetatable(L, "ffi_cbqueue"))
+        goto error;
+    register_funcs(L, cbqueue_metafuncs, -1);
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_async"))
+        goto error;
+    register_funcs(L, async_metafuncs, -1);
+    register_strings(L, async_metastrings, -1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_pool"))
+        goto error;
+    register_funcs(L, pool_metafuncs, -1);
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_arena"))
+        goto error;
+    register_funcs(L, arena_metafuncs, -1);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_cdata"))
+        goto error;
+    register_funcs(L, cdata_metafuncs, -1);
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_buffer"))
+        goto error;
+    register_funcs(L, buffer_metafuncs, -1);
+    lua_settop(L, -2); /* pop */
+    
+    if (!luaL_newmetatable(L, "ffi_int64"))
+        goto error;
+    register_funcs(L, int64_metafuncs, -1);
+    register_strings(L, int64_metastrings, -1);
+    lua_settop(L, -2); /* pop */
+    
     if (!luaL_newmetatable(L, "ffi_lib"))
         goto error;
     register_funcs(L, lib_metafuncs, -1);
     register_strings(L, lib_metastrings, -1);
     lua_settop(L, -2); /* pop */
     
+    if (!luaL_newmetatable(L, "ffi_snapmap"))
+        goto error;
+    register_funcs(L, snapmap_metafuncs, -1);
+    lua_settop(L, -2); /* pop */
+    
+    /* the cif cache, with weak values */
+    lua_pushlightuserdata(L, &cif_cache_key);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* the out type cache, with weak values too */
+    lua_pushlightuserdata(L, &out_cache_key);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
     luaL_openlib(L, "ffi", func, 0);
 
     /* duplicate the ffi base types into lua userdata */
@@ -785,6 +6314,23 @@ exists:
     /* ABI's are light user data (and not lua numbers) to avoid double to
      * int conversion later (void * to int is much faster) */
     register_lightuserdata(L, abis, -1);
+    register_ints(L, dl_flags, -1);
+
+    /* the ffi table and the declarations of ffi.cdef */
+    lua_pushlightuserdata(L, &ffi_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, &cdecl_key);
+    lua_newtable(L);
+    for (i = 0; cdecl_builtins[i].name; i++) {
+        lua_getfield(L, -3, cdecl_builtins[i].string);
+        lua_setfield(L, -2, cdecl_builtins[i].name);
+    }
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, &forward_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
     
     return 1;
 
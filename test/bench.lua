@@ -0,0 +1,493 @@
+#!/usr/bin/lua5.1
+
+-- micro benchmarks for the call paths, run from the test directory
+-- usage: lua bench.lua [iterations]
+
+package.cpath = ";;../?.so"
+require "luaffi"
+
+local N = tonumber(arg and arg[1]) or 1000000
+local clock = os.clock
+
+local function bench(name, n, f)
+   collectgarbage "collect"
+   local t = clock()
+   f(n)
+   t = clock() - t
+   print(string.format("%-32s %10.1f ns/call", name, t * 1e9 / n))
+end
+
+local lib = ffi.open_lib("./test.so")
+
+
+-- ffi.call with 0 to 8 int arguments
+
+local args = { }
+for nargs = 0, 8 do
+   local types = { }
+   for i = 1, nargs do types[i] = ffi.Tint end
+   local cif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, unpack(types))
+   local f = ffi.get_symbol(lib, "bench" .. nargs)
+   local call = ffi.call
+   local a, b, c, d, e, g, h, i = 1, 2, 3, 4, 5, 6, 7, 8
+
+   bench("call, " .. nargs .. " args", N, function(n)
+      for _ = 1, n do
+         call(cif, f, a, b, c, d, e, g, h, i)
+      end
+   end)
+end
+
+
+-- the same calls through bound callables
+
+for nargs = 0, 8 do
+   local types = { }
+   for i = 1, nargs do types[i] = ffi.Tint end
+   local cif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, unpack(types))
+   local f = ffi.bind(cif, ffi.get_symbol(lib, "bench" .. nargs))
+   local a, b, c, d, e, g, h, i = 1, 2, 3, 4, 5, 6, 7, 8
+
+   bench("bind, " .. nargs .. " args", N, function(n)
+      for _ = 1, n do
+         f(a, b, c, d, e, g, h, i)
+      end
+   end)
+end
+
+
+-- struct returns: new userdata per call against a recycled pool
+
+local Tpoint = ffi.struct_new(ffi.Tint, ffi.Tint)
+local pointcif = ffi.prep_cif(ffi.DEFAULT_ABI, Tpoint, ffi.Tint, ffi.Tint)
+local fresh = ffi.bind(pointcif, ffi.get_symbol(lib, "benchstruct"))
+local pooled = ffi.bind(pointcif, ffi.get_symbol(lib, "benchstruct"), 16)
+
+for _, t in ipairs { { "struct return, new userdata", fresh }, { "struct return, pool of 16", pooled } } do
+   local f = t[2]
+   bench(t[1], N, function(n)
+      for i = 1, n do f(i, i) end
+   end)
+end
+
+
+-- bulk array conversion against the per element accessors
+
+local libc = ffi.open_lib(nil)
+local malloc = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tpointer, ffi.Tulong), ffi.get_symbol(libc, "malloc"))
+local free = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tvoid, ffi.Tpointer), ffi.get_symbol(libc, "free"))
+local count = 10000
+local buf = malloc(8 * count)
+local values = { }
+for i = 1, count do values[i] = i * 0.5 end
+
+for _, t in ipairs { { "float", ffi.Tfloat, 4 }, { "int32", ffi.Tsint32, 4 }, { "double", ffi.Tdouble, 8 } } do
+   local name, type, size = t[1], t[2], t[3]
+   local r, w = ffi["r" .. name], ffi["w" .. name]
+   local rounds = math.max(1, math.floor(N / count / 10))
+
+   bench("r" .. name .. " x" .. count, rounds * count, function()
+      for _ = 1, rounds do
+         local tbl = { }
+         for i = 1, count do tbl[i] = r(nil, buf, (i - 1) * size, 0) end
+      end
+   end)
+   bench("read_array " .. name .. " x" .. count, rounds * count, function()
+      for _ = 1, rounds do ffi.read_array(buf, type, count) end
+   end)
+   bench("w" .. name .. " x" .. count, rounds * count, function()
+      for _ = 1, rounds do
+         for i = 1, count do w(values[i], buf, (i - 1) * size, 0) end
+      end
+   end)
+   bench("write_array " .. name .. " x" .. count, rounds * count, function()
+      for _ = 1, rounds do ffi.write_array(buf, type, values) end
+   end)
+end
+
+free(buf)
+
+
+-- callbacks: qsort with a lua comparator
+
+local count = N
+local qsort = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tvoid, ffi.Tpointer, ffi.Tulong, ffi.Tulong, ffi.Tpointer),
+		       ffi.get_symbol(libc, "qsort"))
+local rint = ffi.rint
+local compare = ffi.closure_new(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tpointer),
+				function(a, b) return rint(nil, a) - rint(nil, b) end)
+local ints = { }
+for i = 1, count do ints[i] = math.random(0, 2^30) end
+local buf = malloc(4 * count)
+ffi.write_array(buf, ffi.Tint, ints)
+
+local calls = 0
+local counting = ffi.closure_new(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tpointer),
+				 function(a, b) calls = calls + 1 return rint(nil, a) - rint(nil, b) end)
+qsort(buf, count, 4, counting.func)
+ffi.write_array(buf, ffi.Tint, ints)
+
+bench("qsort callback, " .. count .. " ints", calls, function()
+   qsort(buf, count, 4, compare.func)
+end)
+
+local sorted = ffi.read_array(buf, ffi.Tint, count)
+for i = 2, count do assert(sorted[i - 1] <= sorted[i]) end
+free(buf)
+
+
+-- callbacks fired from a native thread: each batch fits in the queue, so
+-- this measures enqueueing plus dispatch rather than thread scheduling
+
+local cbthread_start = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tpointer, ffi.Tpointer, ffi.Tint),
+				ffi.get_symbol(lib, "cbthread_start"))
+local cbthread_join = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer),
+			       ffi.get_symbol(lib, "cbthread_join"))
+local poll = ffi.poll_callbacks
+local batch = 1000
+local cb = ffi.closure_new(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tdouble),
+			   function(i, d) return i end, "async")
+
+bench("thread callback, async", N, function(n)
+   for _ = 1, n / batch do
+      cbthread_join(cbthread_start(cb.func, batch))
+      assert(poll() == batch)
+   end
+end)
+
+
+-- asynchronous calls: round trip of one call, and batches of queued calls
+
+local cif2 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint)
+local bench2 = ffi.get_symbol(lib, "bench2")
+local call_async = ffi.call_async
+ffi.async_pool(2, 256)
+
+bench("call_async + wait", N / 10, function(n)
+   for i = 1, n do
+      call_async(cif2, bench2, i, 1):wait()
+   end
+end)
+
+bench("call_async, batches of 256", N, function(n)
+   local hs = { }
+   for k = 1, n / 256 do
+      for i = 1, 256 do hs[i] = call_async(cif2, bench2, i, k) end
+      for i = 1, 256 do hs[i]:wait() end
+   end
+end)
+
+local stats = ffi.async_stats()
+print(string.format("%-32s %10.1f us", "async queue wait, mean", stats.wait_ns / stats.completed / 1e3))
+
+
+-- coroutines yielding on bound calls, resumed by the dispatcher
+
+local abench2 = ffi.bind_async(cif2, bench2)
+local dispatch = ffi.dispatch_completions
+ffi.async_pool(2, 1024)
+
+bench("bind_async, coroutine resumes", N / 10, function(n)
+   local done = 0
+   local body = function(i) abench2(i, 1) done = done + 1 end
+   for k = 1, n / 1000 do
+      for i = 1, 1000 do coroutine.resume(coroutine.create(body), i) end
+      while done < k * 1000 do dispatch() end
+   end
+end)
+
+
+-- prep_cif for a signature seen before
+
+local Tint, Tpointer, Tdouble = ffi.Tint, ffi.Tpointer, ffi.Tdouble
+bench("prep_cif, same signature", N / 10, function(n)
+   for i = 1, n do
+      ffi.prep_cif(ffi.DEFAULT_ABI, Tint, Tpointer, Tint, Tdouble)
+   end
+end)
+
+
+-- variadic calls: a shape cached cif against a cif built per call
+
+local snprintf = ffi.get_symbol(libc, "snprintf")
+local fixed = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tulong, ffi.Tpointer)
+local vbuf = malloc(64)
+
+bench("call_var, snprintf %d %g", N / 10, function(n)
+   for i = 1, n do
+      ffi.call_var(fixed, snprintf, vbuf, 64, "%d %g", i, 0.5)
+   end
+end)
+
+bench("prep_cif_var + call, snprintf", N / 10, function(n)
+   for i = 1, n do
+      local cif = ffi.prep_cif_var(ffi.DEFAULT_ABI, ffi.Tint, 3, ffi.Tpointer, ffi.Tulong, ffi.Tpointer,
+				   ffi.Tint, ffi.Tdouble)
+      ffi.call(cif, snprintf, vbuf, 64, "%d %g", i, 0.5)
+   end
+end)
+free(vbuf)
+
+
+-- ffi.cdef on a generated header of 5000 lines, the time is per line
+
+local hdr, lines, blocks = { }, 0, 358
+for i = 1, blocks do
+   hdr[#hdr + 1] = string.format([[
+/* block %d */
+typedef struct s%d {
+    int id;
+    double values[4];
+    const char *name;
+    struct s%d *next;
+} s%d_t;
+enum e%d { E%d_A = %d, E%d_B, E%d_C = E%d_B << 1 };
+typedef int (*cb%d_t)(s%d_t *s, void *data);
+s%d_t *s%d_new(const char *name, unsigned long size);
+void s%d_free(s%d_t *s);
+int s%d_each(s%d_t *s, cb%d_t cb, void *data);
+double s%d_sum(const s%d_t *s, int n, ...);
+unsigned long long s%d_hash(const void *p, size_t len);
+]], i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i, i)
+end
+hdr = table.concat(hdr)
+for _ in hdr:gmatch "\n" do lines = lines + 1 end
+
+bench("cdef, " .. lines .. " line header", lines * 20, function(n)
+   for _ = 1, 20 do
+      ffi.cdef(hdr)
+   end
+end)
+
+
+-- startup: the bindings of the header above built from lua with eager
+-- symbol lookups, parsed, or loaded from a snapshot, the time is per block
+
+local Tint, Tulong, Tuint64 = ffi.Tint, ffi.Tulong, ffi.Tuint64
+local Tdouble, Tpointer, ABI = ffi.Tdouble, ffi.Tpointer, ffi.DEFAULT_ABI
+bench("startup, from lua", blocks * 20, function(n)
+   for _ = 1, 20 do
+      local b = { }
+      for i = 1, blocks do
+         local p = "s" .. i
+         b[p .. "_t"] = ffi.struct_new("id", Tint, "values", ffi.array_new(Tdouble, 4),
+                                       "name", Tpointer, "next", Tpointer)
+         b["E" .. i .. "_A"], b["E" .. i .. "_B"], b["E" .. i .. "_C"] = i, i + 1, 2 * (i + 1)
+         for name, cif in pairs {
+            _new = ffi.prep_cif(ABI, Tpointer, Tpointer, Tulong),
+            _free = ffi.prep_cif(ABI, ffi.Tvoid, Tpointer),
+            _each = ffi.prep_cif(ABI, Tint, Tpointer, Tpointer, Tpointer),
+            _sum = ffi.prep_cif(ABI, Tdouble, Tpointer, Tint),
+            _hash = ffi.prep_cif(ABI, Tuint64, Tpointer, Tulong) } do
+            b[p .. name] = { cif, ffi.get_symbol(lib, p .. name) }
+         end
+      end
+   end
+end)
+
+bench("startup, cdef", blocks * 20, function(n)
+   for _ = 1, 20 do
+      ffi.cdef(hdr)
+   end
+end)
+
+local snap = os.tmpname()
+ffi.save_bindings(snap)
+bench("startup, load_bindings", blocks * 20, function(n)
+   for _ = 1, 20 do
+      ffi.load_bindings(snap)
+   end
+end)
+os.remove(snap)
+
+
+-- looking up and calling a declared function
+
+ffi.cdef "int bench2(int a, int b);"
+local nslib, ns = ffi.open_lib("./test.so"), ffi.load("./test.so")
+bench("lib.bench2(1, 2)", N, function(n)
+   for i = 1, n do
+      nslib.bench2(1, 2)
+   end
+end)
+
+bench("ns.bench2(1, 2)", N, function(n)
+   for i = 1, n do
+      ns.bench2(1, 2)
+   end
+end)
+
+local getsym, bench2cif = ffi.get_symbol, ffi.cif "bench2"
+bench("get_symbol + call", N, function(n)
+   for i = 1, n do
+      ffi.call(bench2cif, getsym(nslib, "bench2"), 1, 2)
+   end
+end)
+
+
+-- resolving a list of symbols, the time is per name
+
+local names = { }
+for i = 1, 900 do names[i] = "bench" .. (i % 9) end
+bench("get_symbols, 900 names", 900 * 100, function(n)
+   for _ = 1, 100 do
+      ffi.get_symbols(nslib, names)
+   end
+end)
+
+bench("get_symbol loop, 900 names", 900 * 100, function(n)
+   for _ = 1, 100 do
+      local t = { }
+      for i = 1, #names do
+         t[names[i]] = getsym(nslib, names[i])
+      end
+   end
+end)
+
+
+-- opening a library again
+
+bench("open_lib, same path", N / 10, function(n)
+   for i = 1, n do
+      ffi.open_lib("./test.so")
+   end
+end)
+
+
+-- 64 bit integers: values that fit a double pass as numbers, others boxed
+
+local xor64 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint64, ffi.Tuint64, ffi.Tsint64)
+local xor64f = ffi.get_symbol(lib, "xor64")
+bench("call, int64 numbers", N, function(n)
+   for i = 1, n do
+      ffi.call(xor64, xor64f, i, 1)
+   end
+end)
+
+local big = ffi.int64 "0x7000000000000000"
+bench("call, int64 boxes", N, function(n)
+   for i = 1, n do
+      ffi.call(xor64, xor64f, big, 1)
+   end
+end)
+
+
+-- strings with their length: one Tlstring against a pointer and #s
+
+local text = string.rep("abc\0", 16)
+local sumls = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint, ffi.Tlstring)
+local sumps = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint, ffi.Tpointer, ffi.Tulong)
+local sumf = ffi.get_symbol(lib, "sumbytes")
+bench("call, Tlstring", N, function(n)
+   for i = 1, n do
+      ffi.call(sumls, sumf, text)
+   end
+end)
+
+bench("call, pointer and #s", N, function(n)
+   for i = 1, n do
+      ffi.call(sumps, sumf, text, #text)
+   end
+end)
+
+local sbuf = ffi.buffer(64, text)
+bench("ffi.string, 64 bytes", N, function(n)
+   for i = 1, n do
+      ffi.string(sbuf, 64)
+   end
+end)
+
+bench("ffi.tostring, 64 bytes", N, function(n)
+   for i = 1, n do
+      ffi.tostring(sbuf)
+   end
+end)
+
+
+-- bulk memory against libc through a cif and per byte loops
+
+local packet = ffi.buffer(1500, string.rep("payload ", 180) .. "MARK")
+local copyto = ffi.buffer(1500)
+local memcpycif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tpointer, ffi.Tpointer, ffi.Tpointer, ffi.Tulong)
+local memcpyf = ffi.get_symbol(ffi.open_lib(), "memcpy")
+bench("ffi.copy, 1500 bytes", N, function(n)
+   for i = 1, n do
+      ffi.copy(copyto, packet, 1500)
+   end
+end)
+
+bench("memcpy cif, 1500 bytes", N, function(n)
+   for i = 1, n do
+      ffi.call(memcpycif, memcpyf, copyto, packet, 1500)
+   end
+end)
+
+bench("ffi.find, 1500 bytes", N / 10, function(n)
+   for i = 1, n do
+      ffi.find(packet, 1500, "MARK")
+   end
+end)
+
+bench("ruint8 loop, 1500 bytes", N / 1000, function(n)
+   for i = 1, n do
+      for j = 0, 1499 do
+         if ffi.ruint8(nil, packet, j, 0) == 77 then break end
+      end
+   end
+end)
+
+
+-- scratch memory: arenas and ffi.new against malloc and free through cifs
+
+local libc = ffi.open_lib()
+local malloccif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tpointer, ffi.Tulong)
+local freecif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tvoid, ffi.Tpointer)
+local mallocf, freef = ffi.get_symbol(libc, "malloc"), ffi.get_symbol(libc, "free")
+bench("malloc + free, 256 bytes", N, function(n)
+   for i = 1, n do
+      ffi.call(freecif, freef, ffi.call(malloccif, mallocf, 256))
+   end
+end)
+
+local scratch = ffi.arena()
+bench("arena alloc, 256 bytes", N, function(n)
+   for i = 1, n, 100 do
+      for j = 1, 100 do
+         scratch:alloc(256)
+      end
+      scratch:reset()
+   end
+end)
+
+bench("ffi.new, 256 bytes", N / 10, function(n)
+   for i = 1, n do
+      ffi.new(ffi.Tuint8, 256)
+   end
+end)
+
+bench("ffi.buffer, 256 bytes", N / 10, function(n)
+   for i = 1, n do
+      ffi.buffer(256)
+   end
+end)
+
+
+-- out parameters: frame scratch against a malloc'd cell read back
+
+local divmodf = ffi.get_symbol(lib, "divmod")
+local divout = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint, ffi.Tout(ffi.Tint), ffi.Tout(ffi.Tint))
+bench("call, Tout results", N, function(n)
+   for i = 1, n do
+      local rc, q, r = ffi.call(divout, divmodf, i, 7)
+   end
+end)
+
+local divptr = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint, ffi.Tpointer, ffi.Tpointer)
+bench("call, malloc + rint + free", N, function(n)
+   for i = 1, n do
+      local cell = ffi.call(malloccif, mallocf, 8)
+      local rc = ffi.call(divptr, divmodf, i, 7, cell, ffi.ptradd(cell, 4))
+      local q, r = ffi.rint(nil, cell), ffi.rint(nil, cell, 4, 0)
+      ffi.call(freecif, freef, cell)
+   end
+end)
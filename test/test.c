@@ -1,5 +1,10 @@
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
 
 short testme(const char *str)
 {
@@ -45,3 +50,288 @@ void structtest3(struct test_t *s)
 {
     printf("a = %d, b = %d into %p\n", s->a, s->b, s);
 }
+
+struct layout_t {
+    char c;
+    double d;
+    short s;
+    struct test_t t;
+    char e;
+};
+
+/* offsets of the fields of struct layout_t, then its size */
+int layouttest(int field)
+{
+    static const int layout[] = {
+        offsetof(struct layout_t, c), offsetof(struct layout_t, d),
+        offsetof(struct layout_t, s), offsetof(struct layout_t, t),
+        offsetof(struct layout_t, e), sizeof(struct layout_t)
+    };
+
+    return layout[field];
+}
+
+/* aggregates as found in wire formats */
+struct wire_t {
+    unsigned char tag;
+    unsigned int len;
+    unsigned short port;
+    char name[5];
+    double value;
+} __attribute__((packed));
+
+union value_t {
+    int i;
+    double d;
+    char bytes[12];
+};
+
+struct outer_t {
+    short kind;
+    union value_t v;
+    struct test_t pts[3];
+    struct wire_t w;
+    char end;
+};
+
+struct aligned_t {
+    char c;
+    int i;
+} __attribute__((aligned(16)));
+
+#pragma pack(push, 2)
+struct pack2_t {
+    char c;
+    int i;
+    double d;
+};
+#pragma pack(pop)
+
+/* offsets and sizes of the aggregates above, see test.lua */
+int aggtest(int which)
+{
+    static const int layout[] = {
+        offsetof(struct wire_t, len), offsetof(struct wire_t, port),
+        offsetof(struct wire_t, name), offsetof(struct wire_t, value), sizeof(struct wire_t),
+        sizeof(union value_t), __alignof__(union value_t),
+        offsetof(struct outer_t, v), offsetof(struct outer_t, pts),
+        offsetof(struct outer_t, w), offsetof(struct outer_t, end), sizeof(struct outer_t),
+        sizeof(struct aligned_t), __alignof__(struct aligned_t),
+        offsetof(struct pack2_t, i), offsetof(struct pack2_t, d), sizeof(struct pack2_t),
+        __alignof__(struct pack2_t)
+    };
+
+    return layout[which];
+}
+
+void aggfill(struct outer_t *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->kind = -2;
+    o->v.d = 2.5;
+    o->pts[2].b = 77;
+    o->w.tag = 9;
+    o->w.port = 8080;
+    strcpy(o->w.name, "wire");
+    o->w.value = -0.25;
+    o->end = 'z';
+}
+
+double mixtest(int a, double b, const char *s, int c)
+{
+    return a + b + strlen(s) * c;
+}
+
+const char *ptrtest(const char *s, int n)
+{
+    return s + n;
+}
+
+/* more arguments than registers, checked against the ffi_call path */
+double jitmix(signed char a, unsigned short b, float c, double d, long long e,
+              const char *s, unsigned char f, short g, double h, int i,
+              float j, double k, double l, double m, double n, double o,
+              int p, unsigned int q)
+{
+    return a + 2.0 * b + 3.0 * c + 4.0 * d + 5.0 * e + 6.0 * strlen(s) + 7.0 * f + 8.0 * g
+        + 9.0 * h + 10.0 * i + 11.0 * j + 12.0 * k + 13.0 * l + 14.0 * m + 15.0 * n
+        + 16.0 * o + 17.0 * p + 18.0 * q;
+}
+
+float jitfloat(float a, double b, short c)
+{
+    return a * b - c;
+}
+
+signed char jitchar(int a)
+{
+    return a;
+}
+
+unsigned short jitushort(unsigned char a, unsigned short b)
+{
+    return a + b;
+}
+
+double scaletest(double x, int k)
+{
+    return x * k;
+}
+
+unsigned int hashtest(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x45d9f3b;
+    x ^= x >> 16;
+    return x;
+}
+
+/* a native thread firing callbacks, like an audio engine or an i/o library would */
+
+struct cbthread_t {
+    pthread_t thread;
+    int (*cb)(int, double);
+    int n;
+    int sum;
+};
+
+static void *cbthread_main(void *p)
+{
+    struct cbthread_t *t = p;
+    int i;
+
+    for (i = 1; i <= t->n; i++)
+        t->sum += t->cb(i, i * 0.5);
+
+    return NULL;
+}
+
+void *cbthread_start(int (*cb)(int, double), int n)
+{
+    struct cbthread_t *t = malloc(sizeof(*t));
+
+    t->cb = cb;
+    t->n = n;
+    t->sum = 0;
+    pthread_create(&t->thread, NULL, cbthread_main, t);
+
+    return t;
+}
+
+int cbthread_join(void *p)
+{
+    struct cbthread_t *t = p;
+    int sum;
+
+    pthread_join(t->thread, NULL);
+    sum = t->sum;
+    free(t);
+
+    return sum;
+}
+
+/* blocking calls for ffi.call_async */
+
+int slowadd(int a, int b, int ms)
+{
+    usleep(ms * 1000);
+    return a + b;
+}
+
+struct test_t slowswap(struct test_t s, int ms)
+{
+    struct test_t res = {s.b, s.a};
+    usleep(ms * 1000);
+    return res;
+}
+
+/* sum of the n bytes at p, zeros included */
+unsigned sumbytes(const unsigned char *p, size_t n)
+{
+    unsigned sum = 0;
+
+    while (n--)
+        sum += *p++;
+    return sum;
+}
+
+/* fill p with n bytes of i % 5, zeros included, and return n */
+size_t fillbytes(unsigned char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        p[i] = i % 5;
+    return n;
+}
+
+/* hand the n bytes at p to a callback, followed by a tag */
+unsigned eachbytes(unsigned (*cb)(const char *, size_t, int), const char *p, size_t n)
+{
+    return cb(p, n, 7);
+}
+
+/* quotient and remainder through out parameters, -1 dividing by 0 */
+int divmod(int a, int b, int *q, int *r)
+{
+    if (!b)
+        return -1;
+    *q = a / b;
+    *r = a % b;
+    return 0;
+}
+
+/* scale *v and swap the fields of *t in place */
+void scaleswap(double *v, double k, struct test_t *t)
+{
+    int a = t->a;
+
+    *v *= k;
+    t->a = t->b;
+    t->b = a;
+}
+
+/* a pair, and its sum through an out parameter */
+struct test_t pairsum(int a, int b, int *sum)
+{
+    struct test_t res = {a, b};
+
+    *sum = a + b;
+    return res;
+}
+
+/* a pair telling whether p is NULL */
+struct test_t nullpair(int a, void *p)
+{
+    struct test_t res = {a, p == NULL};
+    return res;
+}
+
+/* divide through a callback with out parameters */
+int divvia(int (*f)(int, int, int *, int *), int a, int b, double *v)
+{
+    int q = -1, r = -1;
+
+    f(a, b, &q, &r);
+    *v += 0.5;
+    return q * 100 + r;
+}
+
+/* benchmark targets, see bench.lua */
+
+/* 64 bit values past 2^53 */
+uint64_t xor64(uint64_t a, int64_t b)
+{
+    return a ^ (uint64_t) b;
+}
+
+int bench0(void) { return 0; }
+int bench1(int a) { return a; }
+int bench2(int a, int b) { return a + b; }
+int bench3(int a, int b, int c) { return a + b + c; }
+int bench4(int a, int b, int c, int d) { return a + b + c + d; }
+int bench5(int a, int b, int c, int d, int e) { return a + b + c + d + e; }
+int bench6(int a, int b, int c, int d, int e, int f) { return a + b + c + d + e + f; }
+int bench7(int a, int b, int c, int d, int e, int f, int g) { return a + b + c + d + e + f + g; }
+struct test_t benchstruct(int a, int b) { struct test_t res = {a, b}; return res; }
+int bench8(int a, int b, int c, int d, int e, int f, int g, int h) { return a + b + c + d + e + f + g + h; }
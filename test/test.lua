@@ -69,16 +69,7 @@ function makefun(libname, funcname, rtype, ...)
       return 
    end
 
-   local res
-   if rtype == ffi.Tvoid then
-      res = function(...)
-	       ffi.call(cif, pfunc, ...)
-	    end
-   else
-      res = function(...)
-	       return ffi.call(cif, pfunc, ...)
-	    end
-   end
+   local res = ffi.bind(cif, pfunc)
 
    --res = tracecall(res, funcname)
 
@@ -106,9 +97,42 @@ testdouble(332.42)
 testfloat(332.42)
 testchar(42)
 
+-- signatures served by the specialized call stubs
+mixtest = makefun(testlib, "mixtest", ffi.Tdouble, ffi.Tint, ffi.Tdouble, ffi.Tpointer, ffi.Tint)
+ptrtest = makefun(testlib, "ptrtest", ffi.Tpointer, ffi.Tpointer, ffi.Tint)
+assert(mixtest(1, 0.5, "abc", 10) == 31.5)
+assert(ffi.tostring(ptrtest("hello world", 6)) == "world")
+
+-- jit thunks against the ffi_call path
+local function jitcheck(rtype, name, args, ...)
+   local cif = ffi.prep_cif(ffi.DEFAULT_ABI, rtype, ...)
+   local f = ffi.get_symbol(ffi.open_lib(testlib), name)
+   if not ffi.jit(cif, true) then
+      print("no jit thunk for", name)
+      return
+   end
+   local jitted = { ffi.call(cif, f, unpack(args)) }
+   assert(not ffi.jit(cif, false))
+   local expected = { ffi.call(cif, f, unpack(args)) }
+   assert(#jitted == #expected)
+   for i = 1, #expected do
+      assert(jitted[i] == expected[i], name)
+   end
+   print("jit", name, unpack(jitted))
+end
+
+jitcheck(ffi.Tdouble, "jitmix", { -3, 60000, 1.5, 2.25, -1e12, "four", 200, -300, 0.125, -7, 2.5, 1, 2, 3, 4, 5, -6, 4000000000 },
+	 ffi.Tschar, ffi.Tushort, ffi.Tfloat, ffi.Tdouble, ffi.Tsint64, ffi.Tpointer, ffi.Tuchar, ffi.Tshort, ffi.Tdouble,
+	 ffi.Tint, ffi.Tfloat, ffi.Tdouble, ffi.Tdouble, ffi.Tdouble, ffi.Tdouble, ffi.Tdouble, ffi.Tint, ffi.Tuint)
+jitcheck(ffi.Tfloat, "jitfloat", { 1.5, 3, 2 }, ffi.Tfloat, ffi.Tdouble, ffi.Tshort)
+jitcheck(ffi.Tschar, "jitchar", { -5 }, ffi.Tint)
+jitcheck(ffi.Tushort, "jitushort", { 250, 65000 }, ffi.Tuchar, ffi.Tushort)
+jitcheck(ffi.Tvoid, "chartest", { 42 }, ffi.Tchar)
+
 -- struct
-Ttest = ffi.struct_new(ffi.Tint, ffi.Tint)
+Ttest = ffi.struct_new("a", ffi.Tint, "b", ffi.Tint)
 print("Ttest", Ttest)
+assert(ffi.sizeof(Ttest) == 8 and ffi.alignof(Ttest) == 4 and ffi.offsetof(Ttest, "b") == 4)
 teststruct = makefun(testlib, "structtest", Ttest, ffi.Tsint, ffi.Tuint)
 test2struct = makefun(testlib, "structtest2", ffi.Tvoid, Ttest)
 test3struct = makefun(testlib, "structtest3", ffi.Tvoid, ffi.Tpointer)
@@ -118,6 +142,37 @@ print(struct)
 test2struct(struct)
 test3struct(struct)
 
+-- struct results into caller supplied storage
+local into = ffi.call_into(struct, ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tint),
+			   ffi.get_symbol(ffi.open_lib(testlib), "structtest"), 1, 2)
+assert(into == struct and ffi.view(Ttest, struct).b == 2)
+local pooled = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tint),
+			ffi.get_symbol(ffi.open_lib(testlib), "structtest"), 2)
+local r1, r2, r3 = pooled(1, 2), pooled(3, 4), pooled(5, 6)
+assert(r1 == r3 and r1 ~= r2 and ffi.view(Ttest, r2).a == 3 and ffi.view(Ttest, r3).a == 5)
+-- missing arguments are nil, not the pool entry
+local nullpair = ffi.bind(ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tpointer),
+			  ffi.get_symbol(ffi.open_lib(testlib), "nullpair"), 2)
+assert(ffi.view(Ttest, nullpair(7)).b == 1 and ffi.view(Ttest, nullpair()).b == 1)
+assert(ffi.view(Ttest, nullpair(7, r1)).b == 0 and select("#", nullpair()) == 1)
+struct = teststruct(42, 332)
+
+-- layout and views
+Tlayout = ffi.struct_new("c", ffi.Tchar, "d", ffi.Tdouble, "s", ffi.Tshort, "t", Ttest, "e", ffi.Tchar)
+layouttest = makefun(testlib, "layouttest", ffi.Tint, ffi.Tint)
+for i = 1, 5 do
+   assert(ffi.offsetof(Tlayout, i) == layouttest(i - 1))
+end
+assert(ffi.sizeof(Tlayout) == layouttest(5))
+assert(ffi.offsetof(Tlayout, "t") == layouttest(3))
+
+local view = ffi.view(Ttest, struct)
+assert(view.a == 42 and view.b == 332 and view[2] == 332 and #view == 2)
+view.b = 333
+assert(view.b == 333)
+test3struct(struct)
+view.b = 332
+
 
 -- string example with the libc
 malloc =     makefun(libc, "malloc",   ffi.Tpointer, ffi.Tulong)
@@ -134,6 +189,138 @@ print(strlen("hello"))
 free(str)
 
 
+-- batched calls over packed and strided buffers
+local n = 100
+local xs, ks, out = malloc(8 * n), malloc(8 * n), malloc(8 * n)
+for i = 0, n - 1 do
+   ffi.wdouble(i + 0.5, ffi.ptradd(xs, 8 * i))
+   ffi.wuint32(i * 2654435761 % 2^32, ffi.ptradd(ks, 8 * i))
+end
+
+local scale = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tdouble, ffi.Tdouble, ffi.Tint)
+ffi.call_many(scale, ffi.get_symbol(ffi.open_lib(testlib), "scaletest"), n, xs, { ks, 8 }, out)
+for i = 0, n - 1 do
+   assert(ffi.rdouble(nil, ffi.ptradd(out, 8 * i)) == (i + 0.5) * ffi.rint(nil, ffi.ptradd(ks, 8 * i)))
+end
+
+local hash = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint32, ffi.Tuint32)
+local hashtest = ffi.get_symbol(ffi.open_lib(testlib), "hashtest")
+for _, jit in ipairs { true, false } do
+   ffi.jit(hash, jit)
+   ffi.call_many(hash, hashtest, n, { ks, 8 }, { out, 4 })
+   for i = 0, n - 1 do
+      assert(ffi.ruint32(nil, ffi.ptradd(out, 4 * i)) == ffi.call(hash, hashtest, ffi.ruint32(nil, ffi.ptradd(ks, 8 * i))))
+   end
+end
+assert(not pcall(ffi.call_many, hash, hashtest, -1, ks, out))
+assert(ffi.call_many(hash, hashtest, 0, ks, nil) == nil)
+-- buffers of known size are bounds checked for every call up front
+local bx, bk, bo = ffi.buffer(32), ffi.new(ffi.Tint, 8), ffi.buffer(32)
+ffi.call_many(scale, ffi.get_symbol(ffi.open_lib(testlib), "scaletest"), 4, bx, { bk, 8 }, bo)
+assert(not pcall(ffi.call_many, scale, ffi.get_symbol(ffi.open_lib(testlib), "scaletest"), 5, bx, bk, nil))
+assert(not pcall(ffi.call_many, hash, hashtest, 5, { bk, 8 }, nil) and ffi.call_many(hash, hashtest, 4, { bk, 8 }, nil) == nil)
+assert(not pcall(ffi.call_many, hash, hashtest, 9, bk, bo) and not pcall(ffi.call_many, hash, hashtest, 4, bk, { bo, 10 }) and not pcall(ffi.call_many, hash, hashtest, 2, { bk, -4 }, nil))
+print("call_many ok")
+
+-- accessors take the pointer second, then offsets but for the last
+-- argument, while ffi.ptradd and ffi.ptrsub apply every offset
+local cell = malloc(16)
+ffi.wint(7, cell)
+ffi.wint(9, cell, 8, 0)
+ffi.wint(11, cell, 4, 0, 0)
+assert(ffi.rint(nil, cell) == 7 and ffi.rint(nil, cell, 8, 0) == 9 and ffi.rint(0, cell, 4, 0) == 11)
+assert(ffi.rint(nil, cell, 8) == 7 and ffi.rint(nil, ffi.ptradd(cell, 8)) == 9)
+assert(ffi.ptradd(cell, 4, 4) == ffi.ptradd(cell, 8) and ffi.ptrsub(ffi.ptradd(cell, 8), 4, 4) == cell)
+assert(ffi.rptr(nil, cell) == ffi.rptr(false, cell, 0))
+free(cell)
+print("accessors ok")
+
+-- bulk array conversion
+local function trunc(v) return v < 0 and math.ceil(v) or math.floor(v) end
+local values = { }
+for i = 1, n do values[i] = (i - 50) * 1.25 end
+for _, t in ipairs { ffi.Tfloat, ffi.Tdouble, ffi.Tint, ffi.Tshort } do
+   ffi.write_array(out, t, values)
+   local back = ffi.read_array(out, t, n)
+   for i = 1, n do
+      assert(back[i] == ((t == ffi.Tint or t == ffi.Tshort) and trunc(values[i]) or values[i]))
+   end
+end
+-- strided: the first int of n { int, int } pairs
+ffi.write_array(out, ffi.Tint, values, 8)
+local packed, strided = ffi.read_array(out, ffi.Tint, 2 * n), ffi.read_array(out, ffi.Tint, n, 8)
+for i = 1, n do
+   assert(packed[2 * i - 1] == trunc(values[i]) and strided[i] == trunc(values[i]))
+end
+assert(#ffi.read_array(out, ffi.Tint, 0) == 0 and not pcall(ffi.read_array, out, ffi.Tint, -1))
+assert(not pcall(ffi.read_array, nil, ffi.Tint, 1) and not pcall(ffi.write_array, nil, ffi.Tint, { 1 }))
+assert(not pcall(ffi.write_array, out, Ttest, { 1 }))
+print("read_array/write_array ok")
+
+-- packed structs, unions, arrays and nested aggregates
+Twire = ffi.struct_new({ pack = 1 }, "tag", ffi.Tuint8, "len", ffi.Tuint32, "port", ffi.Tuint16,
+		       "name", ffi.array_new(ffi.Tchar, 5), "value", ffi.Tdouble)
+Tvalue = ffi.union_new("i", ffi.Tint, "d", ffi.Tdouble, "bytes", ffi.array_new(ffi.Tchar, 12))
+Touter = ffi.struct_new("kind", ffi.Tshort, "v", Tvalue, "pts", ffi.array_new(Ttest, 3), "w", Twire, "end", ffi.Tchar)
+Taligned = ffi.struct_new({ align = 16 }, "c", ffi.Tchar, "i", ffi.Tint)
+Tpack2 = ffi.struct_new({ pack = 2 }, "c", ffi.Tchar, "i", ffi.Tint, "d", ffi.Tdouble)
+
+aggtest = makefun(testlib, "aggtest", ffi.Tint, ffi.Tint)
+local layout = {
+   ffi.offsetof(Twire, "len"), ffi.offsetof(Twire, "port"), ffi.offsetof(Twire, "name"),
+   ffi.offsetof(Twire, "value"), ffi.sizeof(Twire),
+   ffi.sizeof(Tvalue), ffi.alignof(Tvalue),
+   ffi.offsetof(Touter, "v"), ffi.offsetof(Touter, "pts"), ffi.offsetof(Touter, "w"),
+   ffi.offsetof(Touter, "end"), ffi.sizeof(Touter),
+   ffi.sizeof(Taligned), ffi.alignof(Taligned),
+   ffi.offsetof(Tpack2, "i"), ffi.offsetof(Tpack2, "d"), ffi.sizeof(Tpack2), ffi.alignof(Tpack2),
+}
+for i, v in ipairs(layout) do
+   assert(v == aggtest(i - 1), "layout " .. i)
+end
+
+local buf = malloc(ffi.sizeof(Touter))
+makefun(testlib, "aggfill", ffi.Tvoid, ffi.Tpointer)(buf)
+local outer = ffi.view(Touter, buf)
+assert(outer.kind == -2 and outer.v.d == 2.5 and outer["end"] == string.byte("z"))
+assert(#outer.pts == 3 and outer.pts[3].b == 77 and outer.pts[4] == nil)
+assert(outer.w.tag == 9 and outer.w.port == 8080 and outer.w.value == -0.25)
+assert(outer.w.name[1] == string.byte("w") and outer.w.name[5] == 0)
+outer.pts[1] = outer.pts[3]
+assert(outer.pts[1].b == 77)
+for _, bad in ipairs { 5, "abc", false, ffi.ptrsub(buf, buf) } do
+   assert(not pcall(function () outer.pts[2] = bad end))
+end
+outer.v.i = 7
+assert(outer.v.bytes[1] == 7)
+free(buf)
+
+-- array sizes must fit, void and empty types can't be fields
+for _, n in ipairs { -1, 0/0, 2^62, 2^64, 1/0 } do
+   assert(not pcall(ffi.array_new, ffi.Tint, n), tostring(n))
+end
+local Tbig = ffi.array_new(ffi.Tchar, 2^20)
+assert(ffi.sizeof(Tbig) == 2^20 and ffi.sizeof(ffi.array_new(ffi.Tint, 2^61)) == 2^63)
+local bigbuf = malloc(2^20)
+local bigv = ffi.view(Tbig, bigbuf)
+bigv[2^20] = 5
+assert(#bigv == 2^20 and bigv[2^20] == 5)
+free(bigbuf)
+assert(not pcall(ffi.struct_new, "v", ffi.Tvoid) and not pcall(ffi.struct_new, "e", ffi.struct_new()))
+assert(not pcall(ffi.array_new, ffi.Tvoid, 4) and ffi.sizeof(ffi.struct_new("a", ffi.Tint, "f", ffi.array_new(ffi.Tchar, 0))) == 4)
+
+-- libffi can't classify unions, packed or over-aligned structs by value
+for _, t in ipairs { Tvalue, Twire, Touter, Taligned, Tpack2, ffi.array_new(Tvalue, 2) } do
+   assert(not pcall(ffi.prep_cif, ffi.DEFAULT_ABI, t) and not pcall(ffi.prep_cif, ffi.DEFAULT_ABI, ffi.Tvoid, ffi.Tint, t))
+end
+assert(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.struct_new({ pack = 4 }, ffi.Tint, ffi.Tchar), ffi.struct_new({ pack = 1 }, ffi.Tchar, ffi.Tchar)))
+print("aggregates ok")
+
+free(xs)
+free(ks)
+free(out)
+
+
 
 -- closure
 local function func()
@@ -165,3 +352,681 @@ struct2 = ffi.call(closure.cif, closure.func, struct)
 print("struct2", struct2)
 test3struct(struct)
 test3struct(struct2)
+
+
+-- closures called from a native thread
+local cbthread_start = makefun(testlib, "cbthread_start", ffi.Tpointer, ffi.Tpointer, ffi.Tint)
+local cbthread_join = makefun(testlib, "cbthread_join", ffi.Tint, ffi.Tpointer)
+local cbcif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tdouble)
+local n = 2000
+
+-- async: the thread gets 0 back at once, the calls run when polled
+local seen, half = 0, 0
+closure = ffi.closure_new(cbcif, function(i, d)
+   seen = seen + i
+   half = half + d
+   return 1
+end, "async")
+local t = cbthread_start(closure.func, n)
+while seen < n * (n + 1) / 2 do
+   ffi.poll_callbacks(100)
+end
+assert(cbthread_join(t) == 0)
+assert(half == n * (n + 1) / 4)
+assert(ffi.poll_callbacks() == 0)
+
+-- sync: the thread waits for each result
+closure = ffi.closure_new(cbcif, function(i, d) return i * 2 end, "sync")
+t = cbthread_start(closure.func, n)
+local calls = 0
+while calls < n do
+   calls = calls + ffi.poll_callbacks()
+end
+assert(cbthread_join(t) == n * (n + 1))
+
+-- called on the owner thread, they still run directly
+assert(ffi.call(cbcif, closure.func, 21, 0) == 42)
+
+-- calls still queued when their closure is collected are dropped
+do
+   local ran = 0
+   local dropped = ffi.closure_new(cbcif, function() ran = ran + 1 end, "async")
+   assert(cbthread_join(cbthread_start(dropped.func, 50)) == 0)
+   dropped = nil
+   collectgarbage "collect"
+   assert(ffi.poll_callbacks() == 50 and ran == 0)
+   local outcif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tvoid, ffi.Tout(ffi.Tint))
+   assert(not pcall(ffi.closure_new, outcif, print, "async") and ffi.closure_new(outcif, print, "sync"))
+end
+
+
+-- asynchronous calls on the worker pool
+assert(ffi.async_pool(4, 8))
+local testlibh = ffi.open_lib(testlib)
+local slowadd = ffi.get_symbol(testlibh, "slowadd")
+local addcif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint, ffi.Tint)
+local handles = { }
+for i = 1, 16 do
+   handles[i] = assert(ffi.call_async(addcif, slowadd, i, 100, 5))
+end
+for i = 16, 1, -1 do
+   assert(handles[i]:wait() == i + 100)
+   assert(handles[i]:poll() and handles[i]:result() == i + 100)
+end
+
+-- 4 workers with 8 slots each, the rest is refused
+local accepted, refused = { }, 0
+for i = 1, 64 do
+   local h, err = ffi.call_async(addcif, slowadd, i, 0, 20)
+   if h then accepted[#accepted + 1] = h else refused = refused + 1 assert(err) end
+end
+assert(refused > 0 and #accepted <= 32 + 4)
+for _, h in ipairs(accepted) do h:wait() end
+
+-- arguments are copied, strings kept alive until the call has run
+local h = ffi.call_async(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tulong, ffi.Tpointer),
+			 ffi.get_symbol(ffi.open_lib(libcpath), "strlen"), string.rep("x", 100) .. "y")
+collectgarbage "collect"
+assert(h:wait() == 101)
+
+local s = ffi.call(ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tint), ffi.get_symbol(testlibh, "structtest"), 1, 2)
+h = ffi.call_async(ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, Ttest, ffi.Tint), ffi.get_symbol(testlibh, "slowswap"), s, 5)
+ffi.view(Ttest, s).a = 10
+local r = ffi.view(Ttest, h:wait())
+assert(r.a == 2 and r.b == 1)
+
+-- await yields the handle from a coroutine
+local co = coroutine.create(function(a, b)
+   return ffi.call_async(addcif, slowadd, a, b, 5):await() * 2
+end)
+local ok, pending = coroutine.resume(co, 20, 1)
+assert(ok and getmetatable(pending).type == "ffi_async")
+while not pending:poll() do end
+local ok, res = coroutine.resume(co, pending:result())
+assert(ok and res == 42)
+assert(ffi.call_async(addcif, slowadd, 1, 2, 0):await() == 3)
+
+local stats = ffi.async_stats()
+assert(stats.threads == 4 and stats.depth == 8 and stats.pending == 0)
+assert(stats.rejected == refused and stats.completed == stats.submitted)
+assert(stats.wait_max_ns >= 0 and stats.run_ns > 0)
+
+
+-- coroutines yielding on bound calls, resumed on completion
+local aslowadd = ffi.bind_async(addcif, slowadd)
+assert(aslowadd(1, 2, 0) == 3) -- not in a coroutine, synchronous
+assert(ffi.async_pool(4, 16))
+
+local poll = makefun(libc, "poll", ffi.Tint, ffi.Tpointer, ffi.Tulong, ffi.Tint)
+local Tpollfd = ffi.struct_new("fd", ffi.Tint, "events", ffi.Tshort, "revents", ffi.Tshort)
+local pfd = malloc(ffi.sizeof(Tpollfd))
+local pv = ffi.view(Tpollfd, pfd)
+pv.fd, pv.events = ffi.completion_fd(), 1 -- POLLIN
+assert(poll(pfd, 1, 0) == 0)
+
+-- more coroutines than queue slots, the overflow runs synchronously
+local n, results, count = 200, { }, 0
+for i = 1, n do
+   local co = coroutine.create(function()
+      local a = aslowadd(i, 1, 1)
+      results[i] = aslowadd(a, 1, 0)
+      count = count + 1
+   end)
+   assert(coroutine.resume(co))
+end
+while count < n do
+   assert(poll(pfd, 1, 1000) == 1)
+   ffi.dispatch_completions(16)
+end
+for i = 1, n do assert(results[i] == i + 2) end
+assert(ffi.dispatch_completions() == 0 and poll(pfd, 1, 0) == 0)
+
+-- errors in a resumed coroutine surface in the dispatcher
+local co = coroutine.create(function() error("boom " .. aslowadd(1, 1, 0)) end)
+assert(coroutine.resume(co))
+assert(poll(pfd, 1, 1000) == 1)
+local ok, err = pcall(ffi.dispatch_completions)
+assert(not ok and err:find("boom 2"))
+free(pfd)
+
+
+-- interned cifs
+local before = ffi.stats()
+local c1 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, Ttest)
+local c2 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tsint, ffi.Tint, Ttest)
+assert(c1 == c2 and c1 ~= ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, Ttest, ffi.Tint))
+local after = ffi.stats()
+assert(after.cif_hits == before.cif_hits + 1 and after.cif_misses == before.cif_misses + 2)
+
+-- unused ones are dropped, and a cif keeps its types alive
+c1, c2 = nil, nil
+local Tpair = ffi.struct_new("x", ffi.Tint, "y", ffi.Tint)
+local swap = ffi.prep_cif(ffi.DEFAULT_ABI, Tpair, Tpair)
+Tpair = nil
+collectgarbage "collect"
+ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, Ttest)
+assert(ffi.stats().cif_misses == after.cif_misses + 2)
+closure = ffi.closure_new(swap, function(p)
+   local v = ffi.view(ffi.struct_new("x", ffi.Tint, "y", ffi.Tint), p)
+   v.x, v.y = v.y, v.x
+   return p
+end)
+local r = ffi.view(Ttest, ffi.call(swap, closure.func, ffi.call(ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tint),
+								  ffi.get_symbol(testlibh, "structtest"), 3, 4)))
+assert(r.a == 4 and r.b == 3)
+
+
+-- variadic functions
+local libch = ffi.open_lib(libcpath)
+local snprintf, sprintf = ffi.get_symbol(libch, "snprintf"), ffi.get_symbol(libch, "sprintf")
+local buf = malloc(256)
+local vcif = ffi.prep_cif_var(ffi.DEFAULT_ABI, ffi.Tint, 3, ffi.Tpointer, ffi.Tulong, ffi.Tpointer, ffi.Tint, ffi.Tdouble)
+assert(vcif ~= ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tulong, ffi.Tpointer, ffi.Tint, ffi.Tdouble))
+assert(ffi.call(vcif, snprintf, buf, 256, "%d %.2f", 42, 2.5) == 7 and ffi.tostring(buf) == "42 2.50")
+
+-- trailing argument types inferred from the values, one cif per shape
+local fixed = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tulong, ffi.Tpointer)
+local s0 = ffi.stats()
+ffi.call_var(fixed, snprintf, buf, 256, "%d|%g|%s|%d|%p", -7, 0.25, "str", true, nil)
+assert(ffi.tostring(buf) == "-7|0.25|str|1|(nil)")
+for i = 1, 10 do
+   ffi.call_var(fixed, snprintf, buf, 256, "%d %g", i, i + 0.5)
+end
+assert(ffi.tostring(buf) == "10 10.5")
+local s1 = ffi.stats()
+assert(s1.var_misses == s0.var_misses + 2 and s1.var_hits == s0.var_hits + 9)
+
+-- short enough for a stub, but doubles need the jit thunk or ffi_call
+local fixed2 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tpointer, ffi.Tpointer)
+for _, jit in ipairs { true, false } do
+   local was = ffi.jit(jit)
+   assert(ffi.call_var(fixed2, sprintf, buf, "%.1f %.1f", 1.5, 2^40) == 19)
+   assert(ffi.tostring(buf) == "1.5 1099511627776.0")
+   ffi.jit(was)
+end
+
+-- past the cached shapes
+local fmt, args = { }, { }
+for i = 1, 40 do fmt[i], args[i] = "%d", i end
+ffi.call_var(fixed, snprintf, buf, 256, table.concat(fmt, ","), unpack(args))
+assert(ffi.tostring(buf) == table.concat(args, ","))
+free(buf)
+
+
+-- C declarations
+ffi.cdef [[
+/* the aggregates of test.c */
+struct test_t { int a; int b; };
+
+struct wire_t {
+    unsigned char tag;
+    unsigned int len;
+    unsigned short port;
+    char name[5];
+    double value;
+} __attribute__((packed));
+
+typedef union value_t {
+    int i;
+    double d;
+    char bytes[sizeof(int) * 3];
+} value_t;
+
+struct outer_t {
+    short kind;
+    value_t v;
+    struct test_t pts[3];
+    struct wire_t w;
+    char end;
+};
+
+struct aligned_t { char c; int i; } __attribute__((aligned(16)));
+
+#pragma pack(push, 2)
+struct pack2_t { char c; int i; double d; };
+#pragma pack(pop)
+
+enum { FIRST = 3, SECOND, THIRD = SECOND << 2 };
+typedef struct list list_t;
+struct list { list_t *next; const char *name; };
+typedef int (*callback_t)(int, double);
+
+struct test_t structtest(int a, int b);
+int aggtest(int which);
+void aggfill(struct outer_t *o);
+extern double mixtest(int a, double b, const char *s, int c);
+void *cbthread_start(callback_t cb, int n);
+static inline int twice(int x) { return 2 * x; }
+int snprintf(char *str, size_t size, const char *format, ...);
+]]
+
+local function cdeflayout()
+   local cwire, couter = ffi.type "struct wire_t", ffi.type "struct outer_t"
+   local caligned, cpack2 = ffi.type "struct aligned_t", ffi.type "struct pack2_t"
+   local clayout = {
+      ffi.offsetof(cwire, "len"), ffi.offsetof(cwire, "port"), ffi.offsetof(cwire, "name"),
+      ffi.offsetof(cwire, "value"), ffi.sizeof(cwire),
+      ffi.sizeof(ffi.type "value_t"), ffi.alignof(ffi.type "union value_t"),
+      ffi.offsetof(couter, "v"), ffi.offsetof(couter, "pts"), ffi.offsetof(couter, "w"),
+      ffi.offsetof(couter, "end"), ffi.sizeof(couter),
+      ffi.sizeof(caligned), ffi.alignof(caligned),
+      ffi.offsetof(cpack2, "i"), ffi.offsetof(cpack2, "d"), ffi.sizeof(cpack2), ffi.alignof(cpack2),
+   }
+   for i, v in ipairs(clayout) do
+      assert(v == aggtest(i - 1), "cdef layout " .. i)
+   end
+end
+cdeflayout()
+assert(ffi.sizeof(ffi.type "struct list") == 2 * ffi.sizeof(ffi.Tpointer))
+assert(ffi.type "list_t *" == ffi.Tpointer and ffi.type "size_t" == ffi.Tulong)
+assert(ffi.type "struct unknown" == nil and ffi.sizeof(ffi.type "char [4][2]") == 8)
+
+-- typedefs of a tag declared before its definition complete with it
+assert(ffi.type "list_t" == ffi.type "struct list")
+ffi.cdef [[
+typedef struct fwd fwd_t, fwd2_t;
+typedef fwd_t fwdfwd_t;
+typedef union fwdu fwdu_t;
+typedef struct fwd *fwdp_t;
+struct fwd { int a; double b; };
+union fwdu { int i; char c[12]; };
+]]
+assert(ffi.type "fwd_t" == ffi.type "struct fwd" and ffi.type "fwd2_t" == ffi.type "struct fwd")
+assert(ffi.type "fwdfwd_t" == ffi.type "struct fwd" and ffi.type "fwdp_t" == ffi.Tpointer)
+assert(ffi.sizeof(ffi.type "fwdu_t") == 12 and ffi.sizeof(ffi.type "fwd_t [2]") == 32)
+ffi.cdef "typedef struct fwd3 fwd3_t; struct fwd3 { fwd_t f; fwd3_t *self; };"
+assert(ffi.offsetof(ffi.type "fwd3_t", "self") == 16)
+-- a typedef declared again waits on its last tag only
+ffi.cdef "typedef struct fwda fwdab_t; typedef struct fwdb fwdab_t; struct fwda { char c; };"
+assert(ffi.type "fwdab_t" == nil)
+ffi.cdef "struct fwdb { short s; };"
+assert(ffi.type "fwdab_t" == ffi.type "struct fwdb")
+
+-- declared functions are bound on first use
+local clib = ffi.open_lib(testlib)
+assert(clib.FIRST == 3 and clib.SECOND == 4 and clib.THIRD == 16)
+assert(clib.aggtest == clib.aggtest and clib.twice == nil and clib.undeclared == nil)
+local cr = ffi.view(ffi.type "struct test_t", clib.structtest(5, 6))
+assert(cr.a == 5 and cr.b == 6)
+assert(clib.mixtest(1, 0.5, "abc", 2) == mixtest(1, 0.5, "abc", 2))
+assert(ffi.cif "structtest" == ffi.prep_cif(ffi.DEFAULT_ABI, ffi.type "struct test_t", ffi.Tint, ffi.Tint))
+
+local couter = ffi.type "struct outer_t"
+local cbuf = malloc(ffi.sizeof(couter))
+clib.aggfill(cbuf)
+local couterv = ffi.view(couter, cbuf)
+assert(couterv.kind == -2 and couterv.pts[3].b == 77 and couterv.w.port == 8080)
+free(cbuf)
+
+-- variadic functions go through ffi.call_var
+local cbuf = malloc(64)
+assert(ffi.open_lib(libcpath).snprintf(cbuf, 64, "%s=%d", "x", 42) == 4 and ffi.tostring(cbuf) == "x=42")
+free(cbuf)
+
+for _, bad in ipairs { "struct { int x : 3; };", "int f(;", "struct s { struct nope n; };",
+		       "/* open", "typedef unknown_t x;", "union bv { int i; }; int bvarg(int, union bv);",
+		       "struct bvret { char c; } __attribute__((aligned(8))); struct bvret bvret(void);",
+		       "struct huge { int x[4611686018427387904]; };", "struct neg { int x[-1]; };",
+		       "struct vfield { void v; };", "typedef void varr_t[4];" } do
+   local ok, err = pcall(ffi.cdef, bad)
+   assert(not ok and err:match "cdef:1:", bad)
+end
+print("cdef ok")
+
+
+-- binding snapshots
+local snap = os.tmpname()
+assert(ffi.save_bindings(snap))
+
+-- shadow some declarations, the snapshot brings them back
+ffi.cdef "struct test_t { char c; }; enum { FIRST = 9 }; typedef int list_t;"
+assert(ffi.sizeof(ffi.type "struct test_t") == 1)
+assert(ffi.load_bindings(snap) > 30)
+cdeflayout()
+assert(ffi.sizeof(ffi.type "struct test_t") == 8 and ffi.offsetof(ffi.type "struct test_t", "b") == 4)
+assert(ffi.type "list_t" == ffi.type "struct list" and ffi.type "list_t *" == ffi.Tpointer)
+
+local slib = ffi.open_lib(testlib)
+assert(slib.FIRST == 3 and slib.THIRD == 16 and slib.aggtest(4) == aggtest(4))
+local sr = ffi.view(ffi.type "struct test_t", slib.structtest(7, 8))
+assert(sr.a == 7 and sr.b == 8)
+local sbuf = malloc(64)
+assert(ffi.open_lib(libcpath).snprintf(sbuf, 64, "%d%s", 1, "2") == 2 and ffi.tostring(sbuf) == "12")
+free(sbuf)
+
+-- truncated or foreign files are refused
+local f = io.open(snap, "rb")
+local data = f:read "*a"
+f:close()
+ffi.cdef "struct test_t { char c; }; enum { FIRST = 9 };"
+for _, bad in ipairs { data:sub(1, #data - 4), data:sub(1, 30), "LFFB" .. data:sub(5, 8) .. "junk" } do
+   f = io.open(snap, "wb")
+   f:write(bad)
+   f:close()
+   assert(ffi.load_bindings(snap) == nil)
+end
+-- and leave the declarations as they were
+assert(ffi.sizeof(ffi.type "struct test_t") == 1 and ffi.open_lib(testlib).FIRST == 9)
+f = io.open(snap, "wb")
+f:write(data)
+f:close()
+assert(ffi.load_bindings(snap) and ffi.sizeof(ffi.type "struct test_t") == 8)
+os.remove(snap)
+assert(ffi.load_bindings(snap) == nil)
+print("snapshots ok")
+
+
+-- namespaces resolve declared names on first use
+local ns = ffi.load(testlib)
+assert(ffi.load "./nonexistent.so" == nil)
+assert(rawget(ns, "aggtest") == nil and ns.aggtest(4) == aggtest(4))
+assert(rawget(ns, "aggtest") == ns.aggtest and ns.THIRD == 16 and rawget(ns, "THIRD") == 16)
+assert(ns.undeclared == nil and rawget(ns, "undeclared") == nil and ns[1] == nil)
+local nr = ffi.view(ffi.type "struct test_t", ns.structtest(1, 2))
+assert(nr.a == 1 and nr.b == 2)
+local nbuf = malloc(16)
+assert(ffi.load(libcpath).snprintf(nbuf, 16, "%d", 77) == 2 and ffi.tostring(nbuf) == "77")
+free(nbuf)
+
+-- a binding keeps its library loaded
+local nagg = ffi.load(testlib).aggtest
+ns = nil
+collectgarbage "collect"
+assert(nagg(4) == aggtest(4))
+print("namespaces ok")
+
+
+-- dlopen flags and bulk symbol lookups
+local nowlib = ffi.open_lib(testlib, ffi.RTLD_NOW + ffi.RTLD_LOCAL)
+assert(nowlib and ffi.open_lib(testlib, ffi.RTLD_LOCAL) and ffi.load(testlib, ffi.RTLD_NOW).aggtest(4) == aggtest(4))
+assert(ffi.open_lib(testlib, ffi.RTLD_NOLOAD) and not ffi.open_lib("./nonexistent.so", ffi.RTLD_NOW))
+assert(not ffi.RTLD_DEEPBIND or ffi.open_lib(testlib, ffi.RTLD_NOW + ffi.RTLD_DEEPBIND))
+local syms, missing = ffi.get_symbols(nowlib, { "aggtest", "nope1", "structtest", "nope2" })
+assert(syms.aggtest == ffi.get_symbol(nowlib, "aggtest") and syms.structtest and syms.nope1 == nil)
+assert(#missing == 2 and missing[1] == "nope1" and missing[2] == "nope2")
+syms, missing = ffi.get_symbols(nowlib, { "bench0", "bench1" })
+assert(syms.bench0 and syms.bench1 and missing == nil)
+assert(not pcall(ffi.get_symbols, nowlib, { "bench0", { } }))
+print("dl flags ok")
+
+
+-- the library handle cache
+collectgarbage "collect"
+local s0 = ffi.stats()
+local l1, l2 = ffi.open_lib(testlib), ffi.open_lib("../test/" .. testlib)
+local s1 = ffi.stats()
+assert(s1.lib_opens == s0.lib_opens and s1.lib_hits == s0.lib_hits + 2)
+assert(ffi.get_symbol(l1, "aggtest") == ffi.get_symbol(l2, "aggtest"))
+
+-- new flags open it again, it is closed with its last reference
+local flags = ffi.RTLD_NOW + ffi.RTLD_GLOBAL
+local l3 = ffi.open_lib(testlib, flags)
+local s2 = ffi.stats()
+assert(s2.lib_opens == s1.lib_opens + 1 and s2.libs == s1.libs + 1)
+l3 = nil
+collectgarbage "collect"
+local s3 = ffi.stats()
+assert(s3.lib_closes == s2.lib_closes + 1 and s3.libs == s1.libs)
+
+-- unless libraries are resident
+assert(ffi.lib_resident(true) == false)
+ffi.open_lib(testlib, flags)
+collectgarbage "collect"
+local s4 = ffi.stats()
+assert(s4.lib_opens == s3.lib_opens + 1 and s4.lib_closes == s3.lib_closes)
+assert(ffi.open_lib(testlib, flags) and ffi.stats().lib_opens == s4.lib_opens)
+assert(ffi.lib_resident(false) == true)
+
+-- relative paths follow the current directory, bare sonames the search path
+local chdir = makefun(libcpath, "chdir", ffi.Tint, ffi.Tpointer)
+local sr = ffi.stats()
+assert(chdir ".." == 0)
+assert(ffi.open_lib "test/test.so" and ffi.open_lib "test.so" == nil)
+assert(ffi.stats().lib_opens == sr.lib_opens and chdir "test" == 0)
+assert(ffi.open_lib(testlib) and ffi.open_lib "test.so" == nil)
+local m1 = ffi.open_lib "libm.so.6"
+if m1 then
+   sr = ffi.stats()
+   assert(ffi.open_lib "libm.so.6" and ffi.stats().lib_hits == sr.lib_hits + 1 and ffi.stats().lib_opens == sr.lib_opens)
+end
+print("lib cache ok")
+
+
+-- 64 bit integers
+local xor64 = makefun(testlib, "xor64", ffi.Tuint64, ffi.Tuint64, ffi.Tsint64)
+local all = ffi.uint64 "0xffffffffffffffff"
+assert(tostring(all) == "18446744073709551615" and tostring(xor64(all, 0)) == "18446744073709551615")
+assert(tostring(xor64("0x8000000000000001", 0)) == "9223372036854775809")
+assert(xor64(1, 2) == 3 and type(xor64(2^53, 0)) == "number" and type(xor64(2^53 + 2, 0)) == "userdata")
+assert(tostring(xor64(0, ffi.int64 "-9007199254740993")) == "18437736874454810623")
+
+-- only integers convert, strings and numbers alike
+assert(tostring(ffi.int64 " -12 ") == "-12" and tostring(ffi.uint64 "0x10") == "16" and tostring(ffi.int64(-2^63)) == "-9223372036854775808")
+for _, bad in ipairs { "abc", "12abc", "", "-", "1.5", "99999999999999999999", "-9999999999999999999", 0/0, 2^64, -2^63 * 2, 1/0 } do
+   assert(not pcall(ffi.int64, bad) and not pcall(xor64, bad, 0), tostring(bad))
+end
+
+-- arithmetic and comparisons stay in 64 bits
+local big = ffi.int64 "9007199254740993"
+assert(tostring(big + 1) == "9007199254740994" and tostring(big - big) == "0" and tostring(-big) == "-9007199254740993")
+assert(tostring(big * 2) == "18014398509481986" and tostring(ffi.int64(-7) / 2) == "-3" and tostring(ffi.int64(-7) % 2) == "-1")
+assert(big + 1 > big and big <= big and big == ffi.int64(2^53) + 1 and ffi.int64(1) ~= ffi.uint64(2))
+assert(ffi.uint64(-1) > ffi.uint64(1) and ffi.int64(-1) < ffi.int64(1) and ffi.int64(-1) < ffi.uint64(1) == false)
+assert(not pcall(function() return big / 0 end) and ffi.tonumber(big) == 2^53 and ffi.tonumber(3) == 3)
+
+-- memory, arrays, closures and variadic calls
+local p = malloc(32)
+ffi.wint64(big, p)
+assert(ffi.rint64(nil, p) == big and ffi.ruint64(nil, p) == ffi.uint64(big))
+ffi.wuint64(all, p)
+assert(ffi.rint64(nil, p) == -1 and ffi.ruint64(nil, p) == all)
+ffi.write_array(p, ffi.Tsint64, { big, -big, 5 })
+local a64 = ffi.read_array(p, ffi.Tsint64, 3)
+assert(a64[1] == big and a64[2] == -big and a64[3] == 5)
+local id64 = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tsint64, ffi.Tsint64)
+local c64 = ffi.closure_new(id64, function(v) return v + 1 end)
+assert(ffi.call(id64, c64.func, big) == big + 1 and ffi.call(id64, c64.func, 41) == 42)
+ffi.call_var(fixed, snprintf, p, 32, "%lld", -big)
+assert(ffi.tostring(p) == "-9007199254740993")
+free(p)
+print("int64 ok")
+
+-- length-aware strings and buffers
+do
+   local bin = "a\0b\0\255"
+   local sumbytes = makefun(testlib, "sumbytes", ffi.Tuint, ffi.Tlstring)
+   assert(sumbytes(bin) == 97 + 98 + 255 and sumbytes("") == 0 and sumbytes(nil) == 0)
+
+   -- a buffer filled by C becomes a string with its zeros
+   local buf = ffi.buffer(12, "xyz")
+   assert(#buf == 12 and ffi.string(buf) == "xyz" and ffi.string(buf, 4) == "xyz\0")
+   local n = makefun(testlib, "fillbytes", ffi.Tsize_t or ffi.Tulong, ffi.Tlstring)(buf)
+   assert(n == 12 and ffi.string(buf, n) == "\0\1\2\3\4\0\1\2\3\4\0\1")
+   assert(sumbytes(buf) == 21 and ffi.string(buf, 0) == "" and ffi.string(nil) == nil)
+   -- lengths are sizes, bounded by what a buffer holds
+   assert(not pcall(ffi.string, buf, -1) and not pcall(ffi.string, buf, 13) and not pcall(ffi.string, buf, 0/0))
+   assert(ffi.string(ffi.buffer(4, "abcd")) == "abcd" and ffi.string(ffi.new(ffi.Tint)) == "")
+   assert(not pcall(ffi.buffer, -1) and not pcall(ffi.buffer, 0/0) and not pcall(ffi.buffer, 2^64))
+
+   -- a closure gets the pair back as one string, and the arguments after it
+   local cbcif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint, ffi.Tlstring, ffi.Tint)
+   local seen
+   local cb = ffi.closure_new(cbcif, function(s, tag) seen = s; return #s * tag end)
+   local each = makefun(testlib, "eachbytes", ffi.Tuint, ffi.Tpointer, ffi.Tlstring)
+   assert(each(cb.func, bin) == 35 and seen == bin)
+
+   -- interned like any cif, not a return type
+   assert(ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tuint, ffi.Tlstring, ffi.Tint) == cbcif)
+   assert(not ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tlstring))
+end
+print("lstring ok")
+
+-- bulk memory
+do
+   local buf = ffi.buffer(16)
+   ffi.copy(buf, "hello\0world")
+   assert(ffi.string(buf, 12) == "hello\0world\0")
+   ffi.copy(buf, "xxWORLDxx", 5, 6, 2)
+   assert(ffi.string(buf, 11) == "hello\0WORLD")
+
+   -- overlapping copies, fills and raw pointers
+   ffi.copy(buf, buf, 5, 1)
+   assert(ffi.string(buf, 6) == "hhello")
+   ffi.fill(buf, 4, 0x2a, 12)
+   ffi.fill(buf, 2)
+   assert(ffi.string(buf, 16) == "\0\0elloWORLD\0****")
+   local p = malloc(16)
+   ffi.copy(p, buf, 16)
+   assert(ffi.compare(p, buf, 16) == 0 and ffi.compare(p, "\0\0elm", 5) == -1)
+   assert(ffi.compare("b", "a", 1) == 1 and ffi.compare(p, buf, 4, 12, 12) == 0)
+   assert(ffi.rint8(nil, ffi.ptradd(p, ffi.int64(12))) == 0x2a and ffi.rint8(nil, p, 12, 0) == 0x2a)
+   assert(ffi.ptrsub(ffi.ptradd(p, 2^33), 2^33) == p)
+
+   -- searches return offsets from the start
+   assert(ffi.find(buf, 16, "WORLD") == 6 and ffi.find(p, 16, 0x2a) == 12)
+   assert(ffi.find(buf, 8, "\0*", 8) == 11 and ffi.find(buf, 8, "WORLD") == nil)
+   assert(ffi.find("abcabc", 6, "ca") == 2 and ffi.find("abc", 3, "") == 0)
+   assert(ffi.find("ab", 2, "abc") == nil and ffi.find(p, 0, 0) == nil)
+   free(p)
+
+   -- userdata and strings are bounds checked, strings are read only
+   assert(not pcall(ffi.copy, buf, "x", 2) and not pcall(ffi.fill, buf, 17))
+   assert(not pcall(ffi.fill, buf, 1, 0, 16) and not pcall(ffi.copy, "abc", "x"))
+   assert(not pcall(ffi.find, "abc", 4, "c") and not pcall(ffi.fill, buf, -1))
+end
+print("bulk memory ok")
+
+-- arenas and typed allocations
+do
+   local arena = ffi.arena(256)
+   local a = arena:alloc(10)
+   local b = arena:alloc(8, 64)
+   local c = arena:alloc(1, 1)
+   local function addr(p) return tonumber(tostring(p):match("0x%x+")) end
+   assert(ffi.ptradd(b, 8) == c and addr(b) - addr(a) >= 10)
+   assert(addr(b) % 64 == 0 and addr(a) % 16 == 0)
+   assert(not pcall(arena.alloc, arena, 1, 3))
+   assert(not pcall(ffi.arena, -1) and not pcall(ffi.arena, 0/0) and not pcall(ffi.arena, 2^64))
+   assert(ffi.arena(2^62) == nil and arena:alloc(2^62) == nil)
+
+   -- past the first chunk, then merged into one by reset
+   ffi.fill(arena:alloc(1000), 1000, 1)
+   local used, size = arena:size()
+   assert(used >= 1000 and size > 256)
+   arena:reset()
+   local used2, size2 = arena:size()
+   assert(used2 == 0 and size2 == size)
+   arena:alloc(10)
+   arena:alloc(1000)
+   assert(select(2, arena:size()) == size)
+
+   -- zeroed, aligned on the type, and freed blocks are reused
+   local point = ffi.struct_new("x", ffi.Tdouble, "y", ffi.Tdouble)
+   local pts = ffi.new(point, 3)
+   assert(#pts == 48 and ffi.compare(pts, string.rep("\0", 48), 48) == 0)
+   local slabs = ffi.stats().slabs
+   local seen = { }
+   for i = 1, 100 do
+      local v = ffi.new(ffi.Tlongdouble)
+      assert(addr(ffi.ptradd(v)) % 16 == 0)
+      seen[ffi.ptradd(v)] = true
+   end
+   collectgarbage "collect"
+   local reused = 0
+   for i = 1, 100 do
+      if seen[ffi.ptradd(ffi.new(ffi.Tlongdouble))] then reused = reused + 1 end
+   end
+   assert(reused > 0 and ffi.stats().slabs - slabs <= 1)
+
+   -- a handle stands for its block in calls, views and accessors
+   local v = ffi.view(point, pts)
+   v.y = 2.5
+   assert(ffi.rdouble(nil, ffi.ptradd(pts, 8)) == 2.5 and ffi.read_array(pts, ffi.Tdouble, 2)[2] == 2.5)
+   local big = ffi.new(ffi.Tuint8, 10000)
+   assert(#big == 10000 and makefun(testlib, "fillbytes", ffi.Tulong, ffi.Tpointer, ffi.Tulong)(big, 10000) == 10000)
+   assert(ffi.string(big, 6) == "\0\1\2\3\4\0" and not pcall(ffi.fill, big, 10001))
+   -- the whole block by default, not the handle
+   local big2 = ffi.new(ffi.Tuint8, 10000)
+   ffi.copy(big2, big)
+   assert(ffi.compare(big2, big, 10000) == 0 and ffi.string(big2, 10000) == ffi.string(big, 10000))
+   ffi.fill(big2, 10000)
+   ffi.copy(big2, big, nil, 0, 9990)
+   assert(ffi.compare(big2, big, 10, 0, 9990) == 0 and ffi.string(big2, 11):byte(11) == 0)
+   assert(not pcall(ffi.copy, big2, big, nil, 0, 10001))
+
+   -- as a struct argument, a destination of results and an async argument
+   local swapcif = ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, Ttest, ffi.Tint)
+   local swapf = ffi.get_symbol(ffi.open_lib(testlib), "slowswap")
+   local arg, dst = ffi.new(Ttest), ffi.new(Ttest)
+   ffi.wint(3, arg)
+   ffi.wint(4, ffi.ptradd(arg, 4))
+   assert(ffi.call_into(dst, swapcif, swapf, arg, 0) == dst)
+   assert(ffi.rint(nil, dst) == 4 and ffi.rint(nil, ffi.ptradd(dst, 4)) == 3 and #dst == 8)
+   local swapinto = ffi.bind(swapcif, swapf, dst)
+   ffi.wint(5, arg)
+   assert(swapinto(arg, 0) == dst and ffi.rint(nil, ffi.ptradd(dst, 4)) == 5)
+   local res = ffi.call_async(swapcif, swapf, arg, 1):wait()
+   assert(ffi.rint(nil, res) == 4 and ffi.rint(nil, ffi.ptradd(res, 4)) == 5)
+   dst, swapinto = nil, nil
+   collectgarbage "collect"
+end
+print("arenas ok")
+
+-- out and inout arguments
+do
+   local Tint_out = ffi.Tout(ffi.Tint)
+   assert(Tint_out == ffi.Tout(ffi.Tint) and Tint_out ~= ffi.Tinout(ffi.Tint) and ffi.sizeof(Tint_out) == ffi.sizeof(ffi.Tpointer))
+   assert(not pcall(ffi.Tout, ffi.Tvoid) and not pcall(ffi.Tout, Tint_out))
+   assert(not ffi.prep_cif(ffi.DEFAULT_ABI, Tint_out))
+
+   -- out values follow the return value, inout ones take an argument
+   local divmod = makefun(testlib, "divmod", ffi.Tint, ffi.Tint, ffi.Tint, Tint_out, Tint_out)
+   assert(select("#", divmod(17, 5)) == 3)
+   local rc, q, r = divmod(17, 5)
+   assert(rc == 0 and q == 3 and r == 2)
+   rc, q, r = divmod(1, 0)
+   assert(rc == -1 and q == 0 and r == 0)
+
+   local scaleswap = makefun(testlib, "scaleswap", ffi.Tvoid, ffi.Tinout(ffi.Tdouble), ffi.Tdouble, ffi.Tinout(Ttest))
+   local t = ffi.new(Ttest)
+   ffi.wint(1, t)
+   ffi.wint(2, ffi.ptradd(t, 4))
+   local v, t2 = scaleswap(1.5, 4, t)
+   assert(v == 6 and ffi.rint(nil, t2) == 2 and ffi.rint(nil, ffi.ptradd(t2, 4)) == 1 and ffi.rint(nil, t) == 1)
+
+   -- through the ffi_call path, variadic calls and call_into
+   local cif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint, Tint_out, Tint_out)
+   local f = ffi.get_symbol(ffi.open_lib(testlib), "divmod")
+   assert(ffi.jit(cif, true) and select(3, ffi.call(cif, f, 9, 4)) == 1)
+   ffi.jit(false)
+   assert(select(3, ffi.call(cif, f, 9, 4)) == 1)
+   ffi.jit(true)
+   local fixed = ffi.prep_cif_var(ffi.DEFAULT_ABI, ffi.Tint, 4, ffi.Tint, ffi.Tint, Tint_out, Tint_out)
+   assert(select(2, ffi.call_var(fixed, f, 9, 4)) == 2)
+   assert(not pcall(ffi.call_many, cif, f, 1, ffi.buffer(4), ffi.buffer(4)))
+
+   -- bound struct results, to a destination or a pool, come first
+   local paircif = ffi.prep_cif(ffi.DEFAULT_ABI, Ttest, ffi.Tint, ffi.Tint, Tint_out)
+   local pairf = ffi.get_symbol(ffi.open_lib(testlib), "pairsum")
+   local pairdst = ffi.new(Ttest)
+   local pairinto, pairpool = ffi.bind(paircif, pairf, pairdst), ffi.bind(paircif, pairf, 2)
+   local pr, sum = pairinto(3, 4)
+   assert(pr == pairdst and sum == 7 and ffi.rint(nil, ffi.ptradd(pairdst, 4)) == 4)
+   pr, sum = pairpool(5, 6)
+   assert(type(pr) == "userdata" and sum == 11 and ffi.rint(nil, pr) == 5)
+   assert(select("#", pairpool(1, 2)) == 2 and select(2, ffi.bind(paircif, pairf)(2, 2)) == 4)
+
+   -- asynchronously, the values come with the result
+   local job = ffi.call_async(cif, f, 23, 10)
+   assert(select(3, job:wait()) == 3)
+
+   -- closures return out values after the return value
+   local divcif = ffi.prep_cif(ffi.DEFAULT_ABI, ffi.Tint, ffi.Tint, ffi.Tint, Tint_out, Tint_out)
+   local cb = ffi.closure_new(divcif, function(a, b) return 0, math.floor(a / b), a % b end)
+   local divvia = makefun(testlib, "divvia", ffi.Tint, ffi.Tpointer, ffi.Tint, ffi.Tint, ffi.Tinout(ffi.Tdouble))
+   local res, d = divvia(cb.func, 47, 10, 1)
+   assert(res == 407 and d == 1.5)
+   local keep = ffi.closure_new(divcif, function(a, b) return 0, nil, 9 end)
+   assert(divvia(keep.func, 1, 1, 0) == -91)
+end
+print("out arguments ok")